@@ -0,0 +1,55 @@
+#include <algorithm>
+#include "ColdStartSession.h"
+
+ColdStartSession::ColdStartSession(Groups* groups, const SearchConfig& cfg) : groups(groups), cfg(cfg), post(groups),
+  used_items(groups->num_items, 0), search(cfg) {
+  items.reserve(cfg.max_count);
+  ratings.reserve(cfg.max_count);
+}
+
+void ColdStartSession::start(uint64_t seed, uint64_t stream) {
+  post.reset();
+  std::fill(used_items.begin(), used_items.end(), 0);
+  items.clear();
+  ratings.clear();
+  search.seed(seed, stream);
+  searched = false;
+  rng_seed = seed;
+  rng_stream = stream;
+}
+
+bool ColdStartSession::done() const {
+  int n = (int)items.size();
+  return n >= cfg.max_count || n >= groups->num_items;
+}
+
+SearchResult ColdStartSession::next_item() {
+  int num_used = (int)items.size();
+  int budget = simulation_budget(cfg, groups->num_items, num_used);
+  SearchResult res = search.next_item(groups, &post, used_items.data(), num_used, budget);
+  searched = true;
+  return res;
+}
+
+SearchResult ColdStartSession::next_item(Search* pooled) {
+  int num_used = (int)items.size();
+  int budget = simulation_budget(cfg, groups->num_items, num_used);
+  // a stream per question, well clear of the streams the search derives for its other trees
+  pooled->seed(rng_seed, rng_stream+((uint64_t)(num_used+1)<<40));
+  return pooled->next_item(groups, &post, used_items.data(), num_used, budget);
+}
+
+bool ColdStartSession::submit_rating(int item, double rating) {
+  if (item < 0 || item >= groups->num_items || used_items[item] || done()) {
+    return false;
+  }
+  if (searched) {
+    // keeps the subtree for item if reuse is on (and it was the item asked about)
+    search.advance(item);
+  }
+  used_items[item] = 1;
+  items.push_back(item);
+  ratings.push_back(rating);
+  post.add_rating(item, rating);
+  return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+// One user's cold-start interview, for embedding the engine in another program: it owns
+// the user's posterior, the items rated so far and a Search (tree node memory and random
+// streams), and shares the read-only model with any other sessions.  A session is used
+// by one thread at a time, e.g.
+//   ColdStartSession s(&groups, cfg);
+//   s.start(seed, stream);
+//   while (!s.done()) {
+//     SearchResult res = s.next_item();
+//     s.submit_rating(res.item, ask_user(res.item));
+//   }
+//   int group = s.estimated_group();
+// start() can be called again for the next user, which keeps the node memory already
+// allocated.  Build with "make lib" and link against libmctsrec.
+
+#include <stdint.h>
+#include <vector>
+#include "Groups.h"
+#include "Posterior.h"
+#include "Search.h"
+
+class ColdStartSession {
+public:
+  Groups* groups;
+  SearchConfig cfg;
+  Posterior post; // group probs given the ratings so far
+  std::vector<int> used_items; // used_items[item] is 1 once the user has rated item
+  std::vector<int> items; // rated items, in order
+  std::vector<double> ratings;
+  Search search;
+
+  ColdStartSession(Groups* groups, const SearchConfig& cfg);
+
+  // begins a new interview with random streams (seed, stream) i.e. a session with the
+  // same streams asks the same questions given the same ratings
+  void start(uint64_t seed, uint64_t stream);
+
+  // true once the user has rated cfg.max_count items, or every item
+  bool done() const;
+
+  // searches for the next item to ask about.  only call when !done()
+  SearchResult next_item();
+
+  // as next_item(), but searching with a Search lent from a pool (made with the same cfg),
+  // e.g. one per server worker thread, so waiting sessions hold no tree memory.  the lent
+  // search is reseeded from this session's streams for each question, so the answer
+  // doesn't depend on which one is lent, but no subtree is kept between questions
+  SearchResult next_item(Search* pooled);
+
+  // records the user's rating of item, usually the one next_item() gave.  returns false,
+  // changing nothing, if item is out of range or already rated, or the session is done
+  bool submit_rating(int item, double rating);
+
+  int estimated_group() const { return post.estimated_group(); }
+  const std::vector<double>& probs() const { return post.probs; }
+  int num_ratings() const { return (int)items.size(); }
+
+private:
+  bool searched = false; // next_item has been called since start, so the search has a tree
+  uint64_t rng_seed = 0, rng_stream = 0; // as given to start()
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+// Reading the model and user rating csv files.  The file is mmapped and split into chunks
+// at line boundaries; the chunks are parsed in parallel straight out of the mapping with
+// std::from_chars, into one row-major array sized from the file itself, so there are no
+// limits on line length or on the numbers of rows and columns.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <charconv>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// files smaller than this many bytes per thread are parsed by fewer threads
+#define CSV_CHUNK_MIN (1<<16)
+
+struct CsvTable {
+  int rows=0, cols=0;
+  std::vector<double> vals; // rows*cols values, row-major
+
+  inline double* row(int r) { return &vals[(size_t)r*cols]; }
+};
+
+inline const char* csv_strtod(const char* p, const char* end, double* val) {
+  // strtod needs a terminated string, and the mapped file isn't
+  char buf[64];
+  size_t n = 0;
+  while (p+n < end && n < sizeof(buf)-1 && p[n] != ',' && p[n] != '\n' && p[n] != '\r') {
+    buf[n] = p[n];
+    n++;
+  }
+  buf[n] = 0;
+  char* stop;
+  *val = strtod(buf, &stop);
+  return p+(stop-buf);
+}
+
+inline const char* csv_parse_double(const char* p, const char* end, double* val) {
+  // parses one number starting at p, returns where it stopped (p if there was no number).
+  // leading blanks and '+' are skipped, like atof
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  if (p < end && *p == '+') p++;
+#ifdef __cpp_lib_to_chars
+  auto res = std::from_chars(p, end, *val);
+  if (res.ec == std::errc::result_out_of_range) {
+    return csv_strtod(p, end, val); // from_chars won't round to inf/0, strtod does
+  }
+  return res.ec == std::errc::invalid_argument ? p : res.ptr;
+#else
+  // no floating point from_chars in this standard library
+  return csv_strtod(p, end, val);
+#endif
+}
+
+inline int csv_count_cols(const char* p, const char* end) {
+  int cols = 1;
+  for (; p < end && *p != '\n'; p++) {
+    cols += (*p == ',');
+  }
+  return cols;
+}
+
+inline bool csv_blank_line(const char* p, const char* end) {
+  for (; p < end && *p != '\n'; p++) {
+    if (*p != ' ' && *p != '\t' && *p != '\r') return false;
+  }
+  return true;
+}
+
+inline CsvTable read_csv(const char* fname) {
+  CsvTable t;
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {
+    char str[FILENAME_MAX];
+    snprintf(str,FILENAME_MAX,"ERROR: Can't open file %s\n",fname);
+    perror(str);
+    exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("ERROR: fstat failed");
+    exit(1);
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return t;
+  }
+  const char* data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("ERROR: mmap of csv file failed");
+    exit(1);
+  }
+  madvise((void*)data, size, MADV_SEQUENTIAL);
+  const char* end = data+size;
+
+  // split into chunks that start at the beginning of a line
+#ifdef _OPENMP
+  int num_chunks = omp_get_max_threads();
+#else
+  int num_chunks = 1;
+#endif
+  if ((size_t)num_chunks > size/CSV_CHUNK_MIN+1) {
+    num_chunks = size/CSV_CHUNK_MIN+1;
+  }
+  std::vector<const char*> chunk(num_chunks+1);
+  chunk[0] = data;
+  for (int c=1; c<num_chunks; c++) {
+    const char* p = data+size*c/num_chunks;
+    p = p > chunk[c-1] ? p : chunk[c-1];
+    const char* nl = (const char*)memchr(p, '\n', end-p);
+    chunk[c] = nl ? nl+1 : end;
+  }
+  chunk[num_chunks] = end;
+
+  // pass 1: count the (non blank) lines in each chunk, so each chunk knows its first row
+  std::vector<int> chunk_rows(num_chunks+1, 0);
+  #pragma omp parallel for num_threads(num_chunks) schedule(static,1)
+  for (int c=0; c<num_chunks; c++) {
+    int n = 0;
+    for (const char* p=chunk[c]; p<chunk[c+1]; ) {
+      const char* nl = (const char*)memchr(p, '\n', chunk[c+1]-p);
+      const char* line_end = nl ? nl : chunk[c+1];
+      n += !csv_blank_line(p, line_end);
+      p = line_end+1;
+    }
+    chunk_rows[c+1] = n;
+  }
+  for (int c=0; c<num_chunks; c++) {
+    chunk_rows[c+1] += chunk_rows[c];
+  }
+  t.rows = chunk_rows[num_chunks];
+  const char* first = data;
+  while (first < end && csv_blank_line(first, end)) {
+    const char* nl = (const char*)memchr(first, '\n', end-first);
+    first = nl ? nl+1 : end;
+  }
+  t.cols = t.rows > 0 ? csv_count_cols(first, end) : 0;
+  t.vals.resize((size_t)t.rows*t.cols);
+
+  // pass 2: parse each chunk into its rows.  errors are reported after the parallel loop
+  std::vector<long> bad_line(num_chunks, -1); // row of the first bad line in each chunk
+  std::vector<int> bad_cols(num_chunks, 0);
+  #pragma omp parallel for num_threads(num_chunks) schedule(static,1)
+  for (int c=0; c<num_chunks; c++) {
+    int r = chunk_rows[c];
+    for (const char* p=chunk[c]; p<chunk[c+1] && bad_line[c]<0; ) {
+      const char* nl = (const char*)memchr(p, '\n', chunk[c+1]-p);
+      const char* line_end = nl ? nl : chunk[c+1];
+      if (!csv_blank_line(p, line_end)) {
+        double* row = &t.vals[(size_t)r*t.cols];
+        int col = 0;
+        const char* q = p;
+        while (true) {
+          double val = 0; // empty fields are 0, like atof
+          q = csv_parse_double(q, line_end, &val);
+          while (q < line_end && (*q == ' ' || *q == '\t' || *q == '\r')) q++;
+          if (col < t.cols) {
+            row[col] = val;
+          }
+          col++;
+          if (q < line_end && *q == ',') {
+            q++;
+          } else {
+            break;
+          }
+        }
+        if (col != t.cols || q != line_end) {
+          bad_line[c] = r;
+          bad_cols[c] = q != line_end ? -1 : col;
+        }
+        r++;
+      }
+      p = line_end+1;
+    }
+  }
+  munmap((void*)data, size);
+  for (int c=0; c<num_chunks; c++) {
+    if (bad_line[c] >= 0) {
+      if (bad_cols[c] < 0) {
+        printf("ERROR: can't parse a number in row %ld of %s\n",bad_line[c]+1,fname);
+      } else {
+        printf("ERROR: inconsistent number of items %d/%d in row %ld of %s\n",t.cols,bad_cols[c],bad_line[c]+1,fname);
+      }
+      exit(1);
+    }
+  }
+  return t;
+}
+
+inline CsvTable read_vals(char* fname) {
+  // read items means from file - csv, with one row for each group
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+    perror("getcwd() error");
+    exit(1);
+  }
+  char valsfile[PATH_MAX+FILENAME_MAX];
+  snprintf(valsfile,sizeof(valsfile),"%s/%s",cwd,fname);
+  CsvTable t = read_csv(valsfile);
+  printf("read from %s, num items %d, num_groups %d\n",valsfile,t.cols,t.rows);
+  return t;
+}
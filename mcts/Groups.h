@@ -1,17 +1,15 @@
 #pragma once
 
-#define USE_GSL 1
-#ifdef USE_GSL
-// GNU Scientific Library - install using "brew install gsl"
-#include <gsl/gsl_rng.h>
-#include <gsl/gsl_randist.h>
-#else
-#include <random>
-#endif
 #include <time.h>
 #include "utils.h"
+#include "Rng.h"
+#include "simd.h"
+#include <vector>
 
-#define MAX_NUM_GROUPS 128
+// least work (group error updates, about a nanosecond each) for reward_batch to share a
+// batch out between threads.  starting a thread team costs microseconds, far more than the
+// few rollouts from a typical leaf take on one thread
+#define LEAF_PARALLEL_MIN_WORK (1<<17)
 
 class Groups {
 public:
@@ -19,81 +17,106 @@ public:
   int num_items;
   double **mu;
   double **sigma2;
-#ifdef USE_GSL
-  gsl_rng *gen;
-#else
-  std::random_device rd{};
-  std::mt19937 gen{rd()}; // mersenne twister, faster?
-  //std::minstd_rand0 gen{rd()}; // faster?
-  std::normal_distribution<> gaussian {0.0,1.0};
-#endif
+  // item-major copy of the model, with the groups for an item padded out to group_stride
+  // and aligned, so updating the error for a rated item over all groups is one contiguous
+  // vectorisable sweep e.g. mu_t[item*group_stride+g]=mu[g][item]
+  int group_stride;
+  double *mu_t;
+  double *sigma2_t;
+  double *inv_sigma2_t; // 1/sigma2
+  double *log_sigma_t; // log(sqrt(sigma2))
+  double *sigma_t; // sqrt(sigma2), scales the pre-generated standard normals
+  // random draws use the caller's Rng and nothing changes the model once it is made, so the
+  // methods used while searching are const and one instance is shared by all threads and
+  // sessions.
+  // when loaded from a binary model file (see Model.h) the item-major arrays point into the
+  // read-only mapped file, and mu and sigma2 are null
   
   void create(int num_groups, double **mu, double **sigma2, int num_items) {
-    if (num_groups>MAX_NUM_GROUPS) {
-      printf("ERROR: number of groups %d > MAX_NUM_GROUPS %d!\n",num_groups,MAX_NUM_GROUPS);
-      exit(1); // this is fatal
-    }
     this->num_groups = num_groups;
     this->mu = mu;
     this->sigma2 = sigma2;
     this->num_items=num_items;
+    group_stride = simd_pad(num_groups);
+    mu_t = simd_alloc((size_t)num_items*group_stride);
+    sigma2_t = simd_alloc((size_t)num_items*group_stride);
+    inv_sigma2_t = simd_alloc((size_t)num_items*group_stride);
+    log_sigma_t = simd_alloc((size_t)num_items*group_stride);
+    sigma_t = simd_alloc((size_t)num_items*group_stride);
+    for (int i=0; i<num_items; i++) {
+      for (int g=0; g<num_groups; g++) {
+        size_t k = (size_t)i*group_stride+g;
+        mu_t[k] = mu[g][i];
+        sigma2_t[k] = sigma2[g][i];
+        inv_sigma2_t[k] = 1.0/sigma2[g][i];
+        log_sigma_t[k] = 0.5*log(sigma2[g][i]);
+        sigma_t[k] = sqrt(sigma2[g][i]);
+      }
+    }
     /*for (int g=0; g<num_groups; g++) {
      printf("g=%d, mu=%g, sigma2=%g\n",g,this->mu[g],this->sigma2[g]);
      }*/
-    // initialise random number generator
-#ifdef USE_GSL
-    const gsl_rng_type *T;
-    gsl_rng_env_setup();
-    //T = gsl_rng_default;
-    T = gsl_rng_taus2; // slightly faster than mersenne twister
-    gen = gsl_rng_alloc(T);
-    gsl_rng_set(gen, (unsigned long)time(NULL));
-#endif
   }
   
-  inline double gaussian(double sigma) {
+  inline double gaussian(double sigma, Rng *rng) const {
     // this is the code hot spot, its the main bottleneck in the whole programme
-    // gsl ziggurat random number generator seems quite a bit faster than standard c++ one.
-#ifdef USE_GSL
-    return gsl_ran_gaussian_ziggurat(gen, sigma);
-#else
-    return gaussian(gen)*sigma;
-#endif
+    return rng->gaussian(sigma);
   }
   
-  inline double mean_rating(int group, int item) {
-    return mu[group][item];
+  inline double mean_rating(int group, int item) const {
+    return mu_t[(size_t)item*group_stride+group];
   }
   
-  inline double rating(int group, int item) {
-    return mu[group][item] + gaussian(sqrt(sigma2[group][item]));
+  inline double rating(int group, int item, Rng *rng) const {
+    // rng hands out standard normals from a pre-generated batch, so no sqrt() per draw
+    size_t k = (size_t)item*group_stride+group;
+    return mu_t[k] + gaussian(sigma_t[k], rng);
   }
   
-  void calc_group_probs(int* items, double* ratings, int num_items, double *probs) {
-    double sum[MAX_NUM_GROUPS]={}, prod[MAX_NUM_GROUPS];
-    for (int g=0; g<num_groups; g++) {
-      prod[g]=1.0;
-    }
+  inline void add_err(int item, double r, double* err) const {
+    // err[g] += (r-mu[g][item])^2/sigma2[g][item] for all groups (err must have group_stride entries)
+    sq_err(mu_t+(size_t)item*group_stride, inv_sigma2_t+(size_t)item*group_stride, r, err, group_stride);
+  }
+  
+  void item_scores(const double* probs, double* scores) const {
+    // how well each item separates the groups, given the current group probs: the expected
+    // KL divergence sum_g,h p_g p_h KL(N(mu_g,sigma2_g) || N(mu_h,sigma2_h)) between the rating
+    // distributions of two groups drawn from probs.  expanding the KL the log sigma terms
+    // cancel, leaving moment sums that take O(num_groups) per item
     for (int i=0; i<num_items; i++) {
+      size_t k = (size_t)i*group_stride;
+      const double* m = mu_t+k;
+      const double* s2 = sigma2_t+k;
+      const double* inv = inv_sigma2_t+k;
+      double second=0, mean=0, inv_sum=0, mu_inv=0, mu2_inv=0;
       for (int g=0; g<num_groups; g++) {
-        sum[g] += (ratings[i]-mu[g][items[i]])*(ratings[i]-mu[g][items[i]])/sigma2[g][items[i]];
-        prod[g] *= sqrt(sigma2[g][items[i]]);
+        second += probs[g]*(s2[g]+m[g]*m[g]);
+        mean += probs[g]*m[g];
+        inv_sum += probs[g]*inv[g];
+        mu_inv += probs[g]*m[g]*inv[g];
+        mu2_inv += probs[g]*m[g]*m[g]*inv[g];
       }
+      scores[i] = 0.5*(second*inv_sum - 2.0*mean*mu_inv + mu2_inv) - 0.5;
     }
-    double sum_prob=0;
-    for (int g=0; g<num_groups; g++) {
-      probs[g] = exp(-sum[g]/2.0)/prod[g];
-      sum_prob += probs[g];
-    }
-    for (int g=0; g<num_groups; g++) {
-      probs[g] = probs[g]/sum_prob;
+  }
+
+  void calc_group_probs(int* items, double* ratings, int num_items, double *probs) const {
+    // log_prod[g] is the log of the product of the sqrt(sigma2) normalising terms
+    std::vector<double> sum(group_stride), log_prod(group_stride);
+    for (int i=0; i<num_items; i++) {
+      add_err(items[i], ratings[i], sum.data());
+      const double* ls = log_sigma_t+(size_t)items[i]*group_stride;
+      for (int g=0; g<group_stride; g++) {
+        log_prod[g] += ls[g];
+      }
     }
+    group_probs(sum.data(), log_prod.data(), num_groups, probs);
   }
   
   
-  inline int estimated_group(int *items, double *ratings, int num_items) {
-    double probs[MAX_NUM_GROUPS];
-    calc_group_probs(items, ratings, num_items, probs);
+  inline int estimated_group(int *items, double *ratings, int num_items) const {
+    std::vector<double> probs(num_groups);
+    calc_group_probs(items, ratings, num_items, probs.data());
     int best_group=0;
     double max=probs[0];
     for (int g=1; g<num_groups; g++) {
@@ -128,32 +151,28 @@ public:
     return best_group;
   }
 
-  inline void  init_reward_err(int* used_items, double* ratings, int num_used_items, double* err) {
+  inline void  init_reward_err(int* used_items, double* ratings, int num_used_items, double* err) const {
     for (int i=0; i<num_used_items; i++) {
       double r = ratings[i];
-      for (int g=0; g<num_groups; g++) {
-        err[g] += (r-mu[g][used_items[i]])*(r-mu[g][used_items[i]])/sigma2[g][used_items[i]];
-      }
+      add_err(used_items[i], r, err);
     }
   }
 
-  inline void  init_reward_err2(int usergroup, int* used_items, double* ratings, int num_used_items, double* err) {
+  inline void  init_reward_err2(int usergroup, int* used_items, double* ratings, int num_used_items, double* err) const {
     for (int i=0; i<num_used_items; i++) {
       double r = ratings[i];
       // double r = rating(usergroup, used_items[i]);
-      for (int g=0; g<num_groups; g++) {
-        err[g] += (r-mu[g][used_items[i]])*(r-mu[g][used_items[i]])/sigma2[g][used_items[i]];
-      }
+      add_err(used_items[i], r, err);
     }
   }
     
-  inline int reward(int user_group, int *items, int num_items, int *rollout_items, int num_rollout_items, double* init_err) {
+  inline int reward(int user_group, int *items, int num_items, int *rollout_items, int num_rollout_items, double* init_err, Rng *rng) const {
     // here we make a fresh draw of ratings for items not yet rated by user
     DEBUG_PRINT("reward num_groups %d\n",num_groups);
     
-    double err[MAX_NUM_GROUPS];
+    double err[group_stride];
     // copy initial value of err array 
-    memcpy(err,init_err,MAX_NUM_GROUPS*sizeof(double));
+    memcpy(err,init_err,group_stride*sizeof(double));
     
     for (int i=0; i<num_items; i++) {
 #ifdef DEBUG_MEM
@@ -162,11 +181,8 @@ public:
         exit(1);
       }
 #endif
-      double r = rating(user_group, items[i]);
-      for (int g=0; g<num_groups; g++) {
-        //printf("g=%d, mu=%g, sigma=%g, val=%g\n",g,mu[g],sigma2[g],pow(r-mu[g],2)/sigma2[g]);
-        err[g] += (r-mu[g][items[i]])*(r-mu[g][items[i]])/sigma2[g][items[i]];
-      }
+      double r = rating(user_group, items[i], rng);
+      add_err(items[i], r, err);
     }
     for (int i=0; i<num_rollout_items; i++) {
 #ifdef DEBUG_MEM
@@ -175,11 +191,8 @@ public:
         exit(1);
       }
 #endif
-      double r = rating(user_group, rollout_items[i]);
-      for (int g=0; g<num_groups; g++) {
-        //printf("g=%d, mu=%g, sigma=%g, val=%g\n",g,mu[g],sigma2[g],pow(r-mu[g],2)/sigma2[g]);
-        err[g] += (r-mu[g][rollout_items[i]])*(r-mu[g][rollout_items[i]])/sigma2[g][rollout_items[i]];
-      }
+      double r = rating(user_group, rollout_items[i], rng);
+      add_err(rollout_items[i], r, err);
     }
     DEBUG_PRINT("reward err[] done\n");
     for (int g=0; g<num_groups; g++) {
@@ -204,13 +217,55 @@ public:
     }
   }
 
-  inline int discounted_reward(int user_group, int *items, int num_items, int *rollout_items, int num_rollout_items, double* init_err) {
+  double reward_batch(int num_batch, const int* user_groups, const int *items, int num_items, const int *rollout_items, const int *num_rollout_items, int stride, const double* z, const double* init_err, int num_threads) const {
+    // evaluates a batch of rollouts in one go, returns the total reward.  rollout b has true group
+    // user_groups[b], rates the path items followed by rollout_items[b*stride...] and uses
+    // the standard normals z[b*stride...] for the ratings.  each rollout sweeps all groups for
+    // each rated item, and the rollouts are shared out between num_threads threads if the
+    // batch is big enough to be worth it
+    size_t work=0;
+    if (num_threads>1) {
+      for (int b=0; b<num_batch; b++) {
+        work += num_items+num_rollout_items[b];
+      }
+      work *= group_stride;
+    }
+    int total=0;
+    #pragma omp parallel for reduction(+:total) num_threads(num_threads) if(work>=LEAF_PARALLEL_MIN_WORK)
+    for (int b=0; b<num_batch; b++) {
+      int user_group = user_groups[b];
+      const double* zb = z+(size_t)b*stride;
+      const int* rb = rollout_items+(size_t)b*stride;
+      double err[group_stride];
+      memcpy(err,init_err,group_stride*sizeof(double));
+      for (int i=0; i<num_items; i++) {
+        size_t k = (size_t)items[i]*group_stride;
+        add_err(items[i], mu_t[k+user_group] + zb[i]*sigma_t[k+user_group], err);
+      }
+      for (int i=0; i<num_rollout_items[b]; i++) {
+        size_t k = (size_t)rb[i]*group_stride;
+        add_err(rb[i], mu_t[k+user_group] + zb[num_items+i]*sigma_t[k+user_group], err);
+      }
+      int best_group=0;
+      double min_err=err[0];
+      for (int g=1; g<num_groups; g++) {
+        if (err[g]<min_err) {
+          min_err=err[g];
+          best_group=g;
+        }
+      }
+      total += (best_group == user_group); // predicted the correct user group
+    }
+    return total;
+  }
+
+  inline int discounted_reward(int user_group, int *items, int num_items, int *rollout_items, int num_rollout_items, double* init_err, Rng *rng) const {
     // here we make a fresh draw of ratings for items not yet rated by user
     DEBUG_PRINT("reward num_groups %d\n",num_groups);
     
-    double err[MAX_NUM_GROUPS];
+    double err[group_stride];
     // copy initial value of err array 
-    memcpy(err,init_err,MAX_NUM_GROUPS*sizeof(double));
+    memcpy(err,init_err,group_stride*sizeof(double));
     
     for (int i=0; i<num_items; i++) {
 #ifdef DEBUG_MEM
@@ -219,11 +274,8 @@ public:
         exit(1);
       }
 #endif
-      double r = rating(user_group, items[i]);
-      for (int g=0; g<num_groups; g++) {
-        //printf("g=%d, mu=%g, sigma=%g, val=%g\n",g,mu[g],sigma2[g],pow(r-mu[g],2)/sigma2[g]);
-        err[g] += (r-mu[g][items[i]])*(r-mu[g][items[i]])/sigma2[g][items[i]];
-      }
+      double r = rating(user_group, items[i], rng);
+      add_err(items[i], r, err);
     }
 
     int best_group=0;
@@ -246,11 +298,8 @@ public:
         exit(1);
       }
 #endif
-      double r = rating(user_group, rollout_items[i]);
-      for (int g=0; g<num_groups; g++) {
-        //printf("g=%d, mu=%g, sigma=%g, val=%g\n",g,mu[g],sigma2[g],pow(r-mu[g],2)/sigma2[g]);
-        err[g] += (r-mu[g][rollout_items[i]])*(r-mu[g][rollout_items[i]])/sigma2[g][rollout_items[i]];
-      }
+      double r = rating(user_group, rollout_items[i], rng);
+      add_err(rollout_items[i], r, err);
     }
     DEBUG_PRINT("reward err[] done\n");
     for (int g=0; g<num_groups; g++) {
@@ -6,71 +6,137 @@
 #include <cstdlib>
 #include <chrono>
 #include <cstring>
-
-#define USE_GSL 1
-#ifdef USE_GSL
-// GNU Scientific Library - install using "brew install gsl"
-#include <gsl/gsl_rng.h>
-#include <gsl/gsl_randist.h>
-#else
-#include <random>
-#endif
+#include <climits>
+#include <algorithm>
 
 #include "Groups.h"
+#include "Posterior.h"
 #include "TreeNode.h"
+#include "Rng.h"
+#include "simd.h"
 #include "utils.h"
 
+// scratch space for the rollouts evaluated as a batch by run_with(), rollout i uses
+// entries [i*stride, (i+1)*stride) of items and z
+struct RolloutBatch {
+  std::vector<int> items, num_items, group;
+  std::vector<double> z;
+  
+  void resize(int num_batch, int stride) {
+    if ((int)group.size() < num_batch || (int)items.size() < num_batch*stride) {
+      items.resize((size_t)num_batch*stride);
+      z.resize((size_t)num_batch*stride);
+      num_items.resize(num_batch);
+      group.resize(num_batch);
+    }
+  }
+};
+
+// the items a session hasn't used yet, for drawing rollout items without replacement.
+// items[0..n) holds them in no particular order and pos[] is the inverse (pos[item]>=n for
+// used items), so an item can be found, moved or removed in O(1)
+struct UnusedItems {
+  std::vector<int> items, pos;
+  int n=0;
+
+  void build(int num_items, const int* used_items) {
+    items.resize(num_items);
+    pos.resize(num_items);
+    n=0;
+    int last=num_items;
+    for (int i=0; i<num_items; i++) {
+      int p = used_items[i] ? --last : n++;
+      items[p]=i;
+      pos[i]=p;
+    }
+  }
+
+  inline void swap_posn(int a, int b) {
+    int ia=items[a], ib=items[b];
+    items[a]=ib; pos[ib]=a;
+    items[b]=ia; pos[ia]=b;
+  }
+
+  inline void remove(int item) {
+    if (pos[item] < n) {
+      swap_posn(pos[item], n-1);
+      n--;
+    }
+  }
+};
+
 class MonteCarloTree {
 public:
-  TreeNode* root=nullptr;
+  int root=-1; // index of root node in treeMem
   TreeNodeMem treeMem;
-  MonteCarloTree() : root(nullptr) {}
-#ifdef USE_GSL
-  gsl_rng *gen;
-  inline double uniform_rnd() {
-    return gsl_rng_uniform(gen);
-  }
-#else
-  std::random_device rd{};
-  std::mt19937 gen{rd()}; // mersenne twister, faster?
-  //std::minstd_rand0 gen{rd()}; // faster?
-  std::uniform_real_distribution<double> uniform(0.0,1.0);
-  inline double uniform_rnd() {
-    return uniform(gen);
+  TreeNodeMem spareMem; // reroot() copies the kept subtree into here
+  MonteCarloTree() : root(-1) {}
+  Rng rng; // each tree has its own random stream, set using seed()
+  // tree parallel search: when shared is set several threads run simulations on this tree
+  // at once, each with its own Rng.  N and Q are then updated atomically, and each thread
+  // adds virtual_loss extra visits (with zero reward) to the nodes on its path while its
+  // simulation is in flight, steering the other threads towards different children.
+  bool shared=false;
+  int virtual_loss=1;
+  // leaf parallel: number of threads used to evaluate the batch of rollouts for a leaf
+  int leaf_threads=1;
+  // rollout items for run() are drawn from here, see Search::sync_unused()
+  UnusedItems unused;
+  // most node memory held at once, updated by note_bytes()
+  size_t peak_bytes=0;
+  // with a memory cap: visits of the busiest node that couldn't get children in this
+  // simulation, and a lower bound on the visits of the expanded nodes left by the last prune()
+  int prune_N=0, prune_floor=0;
+  // if set, nodes are only expanded with these items (see Search::select_candidates)
+  const int* candidates=nullptr;
+  int num_candidates=0;
+  // progressive widening: if >0 (and the tree isn't shared) a node below the root visited N
+  // times only has the first ceil(N^widen_alpha) of the candidates as children, the rest are
+  // added as its visits grow.  needs candidates to give the order
+  double widen_alpha=0.0;
+  
+  void seed(uint64_t seed, uint64_t stream) {
+    rng.seed(seed, stream);
   }
-#endif
 
-  TreeNode* UCB (TreeNode* n)  {		
+  int UCB (int n, Rng *rng)  {
     // find a node with highest score
     double max_score = -1;
-    //TreeNode* bestNode = nullptr;
+    //int bestNode = -1;
 #define MAX_BESTNODES 100
-    TreeNode* bestNodes[MAX_BESTNODES]; int num_bestNodes=0;
+    int bestNodes[MAX_BESTNODES]; int num_bestNodes=0;
     // var=0.25 for a bernoulli RV
-    double logN=0.25*log(n->N*1.0); // move outside loop, compiler seems to not spot this optimisation
-    for (int i = 0; i < n->child_size; ++i) {
-      TreeNode* childNode = n->child[i];
+    double logN=0.25*log(treeMem.N(n)*1.0); // move outside loop, compiler seems to not spot this optimisation
+    // children are contiguous, so scores are calculated a block at a time by the simd
+    // kernel and then scanned in order to pick out the near-ties
+    int first = treeMem.first_child(n);
+    int child_size = treeMem.child_size(n);
+    const int* N = &treeMem.N(first);
+    const double* Q = &treeMem.Q(first);
+#define UCB_BLOCK 64
+    double scores[UCB_BLOCK];
+    for (int b = 0; b < child_size; b+=UCB_BLOCK) {
+      int len = child_size-b < UCB_BLOCK ? child_size-b : UCB_BLOCK;
       
       // TO DO: should choose randomly amongst unvisited nodes
-      if (childNode->N==0) {
+      int unvisited = ucb_scores(Q+b, N+b, len, logN, scores);
+      if (unvisited>=0) {
         // an unvisited node, let's visit it.
-        return childNode;
+        return first+b+unvisited;
       }
       
-      double Q = childNode->Q/childNode->N;
-      //double var = childNode->Q2/childNode->N - Q*Q;
-      double explore = sqrt( logN/childNode->N );
-      double score= Q + explore;
-      
-      if (score > max_score) {
-        max_score = score;
-        bestNodes[0]=childNode;
-        num_bestNodes=1;
-        //bestNode = childNode;
-      } else if ((score > max_score-1.0e-2)&&(num_bestNodes<MAX_BESTNODES)) {
-        // keep rough track of nodes with scores close to the max, we'll treat these as ties.
-        bestNodes[num_bestNodes]=childNode;
-        num_bestNodes++;
+      for (int i = 0; i < len; ++i) {
+        double score = scores[i];
+        if (score > max_score) {
+          max_score = score;
+          bestNodes[0]=first+b+i;
+          num_bestNodes=1;
+          //bestNode = first+b+i;
+        } else if ((score > max_score-1.0e-2)&&(num_bestNodes<MAX_BESTNODES)) {
+          // keep rough track of nodes with scores close to the max, we'll treat these as ties.
+          bestNodes[num_bestNodes]=first+b+i;
+          num_bestNodes++;
+        }
       }
     }	
     
@@ -78,13 +144,12 @@ public:
      /*
      // more exact book-keeping of ties, but slower.
      num_bestNodes=0;
-     for (int i = 0; i < n->child_size; ++i) {
-       TreeNode* childNode = n->child[i];
-       double exploit = childNode->Q*1.0/childNode->N;
-       double explore = sqrt( 2*log( n->N*1.0)/childNode->N );
+     for (int i = 0; i < child_size; ++i) {
+       double exploit = Q[i]*1.0/N[i];
+       double explore = sqrt( 2*log( treeMem.N(n)*1.0)/N[i] );
        double score= exploit + explore ;
        if ( (score-max_score)<1.0e-2 && (score-max_score)>-1.0e-2) {
-          bestNodes[num_bestNodes]=childNode;
+          bestNodes[num_bestNodes]=first+i;
           num_bestNodes++;
           if (num_bestNodes>=MAX_BESTNODES) break;
        }
@@ -92,95 +157,116 @@ public:
      */
     
     // break ties randomly
-    int rnd = (int) ( uniform_rnd() * (num_bestNodes-1) + 0.5);
+    int rnd = (int) ( rng->uniform() * (num_bestNodes-1) + 0.5);
     return bestNodes[rnd];
   }
   
-  int select(TreeNode** path) {
+  inline bool widening() {
+    return widen_alpha > 0 && !shared && candidates != nullptr;
+  }
+
+  inline int widen_target(int node) {
+    // number of children node should have, the root always gets all the candidates
+    if (treeMem.item(node) < 0) {
+      return num_candidates;
+    }
+    int N = treeMem.N(node);
+    return (int)ceil(pow(N > 1 ? N : 1, widen_alpha));
+  }
+
+  int select(int* path, Rng *rng, int num_items, int* used_items) {
     int num_path=0;
-    TreeNode* current = root;
+    int current = root;
     path[num_path] = current;
     num_path++;
-    DEBUG_PRINT("select %d/%d\n",current->item,current->child_size);
-    while (current->child_size != 0) {
+    DEBUG_PRINT("select %d/%d\n",treeMem.item(current),treeMem.child_size(current));
+    while (__atomic_load_n(&treeMem.child_size(current), __ATOMIC_ACQUIRE) != 0) {
+      if (widening()) {
+        widen(&treeMem, current, path, num_path, num_items, used_items, candidates, num_candidates, widen_target(current));
+        if (treeMem.full && treeMem.N(current) > prune_N) {
+          prune_N = treeMem.N(current);
+        }
+      }
       // move to best child node
-      current = UCB(current);
+      current = UCB(current, rng);
+      if (shared) {
+        atomic_add(&treeMem.N(current), virtual_loss);
+      }
       path[num_path] = current;
       num_path++;
-      DEBUG_PRINT("select added %d\n",current->item);
+      DEBUG_PRINT("select added %d\n",treeMem.item(current));
     }
     return num_path;
   }
   
-  int rollout(Groups *groups, int *used_items, int num_path_items, int max_count, int* rollout_items) {
-    // random rollout
-    DEBUG_PRINT("rollout, num_path_items %d max_count %d num_items %d\n", num_path_items, max_count,groups->num_items);
-    int tmp_used_items[groups->num_items];
-    memcpy(tmp_used_items,used_items,groups->num_items*sizeof(int));
-    /*for (int i=0; i<groups->num_items;i++){
-     if (tmp_used_items[i]!=0) {
-     printf("%d/%d ",i,tmp_used_items[i]);
-     }
-     }
-     printf("\n");*/
-    int num_rollout_items=0;
-    for (int i=num_path_items; i<max_count; i++) {
-      // choose random item, not already selected
-      int item = (int) ( uniform_rnd() * (groups->num_items-1) + 0.5); // round
-      DEBUG_PRINT("rollout item %d\n",item);
-      int old_item = item;
-      while (tmp_used_items[item]) {
-        item = (int) ( uniform_rnd() * (groups->num_items-1) + 0.5); // round
-        //printf("%d ",item);
-      }
-      if (item != old_item) {
-        DEBUG_PRINT("rollout replaced dup item %d with %d\n",old_item,item);
+  int rollout(UnusedItems* pool, const int* path_items, int num_path_items, int count, int* rollout_items, Rng *rng) {
+    // random rollout of count items drawn without replacement from the unused items that
+    // aren't on the path.  the path items are swapped to the end of the pool, then a partial
+    // Fisher-Yates shuffle of the rest leaves the rollout items at the front, so each
+    // rollout costs O(count).  the swaps only reorder items[0..n), which holds the same
+    // items afterwards, so they aren't undone
+    int n = pool->n;
+    for (int i=0; i<num_path_items; i++) {
+      int p = pool->pos[path_items[i]];
+      if (p < n) {
+        pool->swap_posn(p, n-1);
+        n--;
       }
-      rollout_items[num_rollout_items]=item;
-      num_rollout_items++;
-      tmp_used_items[item]=1;
-      DEBUG_PRINT("rollout added item %d\n",item);
     }
-    DEBUG_PRINT("rollout done, num_rollout_items %d: ", num_rollout_items); print_items(rollout_items,num_rollout_items);
-    return num_rollout_items;
+    count = count < n ? count : n;
+    for (int i=0; i<count; i++) {
+      pool->swap_posn(i, i+(int)rng->below(n-i));
+      rollout_items[i] = pool->items[i];
+    }
+    DEBUG_PRINT("rollout done, num_rollout_items %d: ", count > 0 ? count : 0); print_items(rollout_items,count);
+    return count > 0 ? count : 0;
   }
   
-  void backpropagate(double result, TreeNode** path, int num_path) {
+  void backpropagate(double result, int* path, int num_path) {
+    if (shared) {
+      // virtual loss was added to all nodes on the path except the root, replace it by the real visit
+      atomic_add(&treeMem.N(path[0]), 1);
+      atomic_add(&treeMem.Q(path[0]), result);
+      for (int i=1; i<num_path; i++) {
+        atomic_add(&treeMem.N(path[i]), 1-virtual_loss);
+        atomic_add(&treeMem.Q(path[i]), result);
+      }
+      return;
+    }
     for (int i=0; i<num_path; i++) {
-      path[i]->N++;
-      path[i]->Q+=result;
-      //path[i]->Q2+=result*result;
+      treeMem.N(path[i])++;
+      treeMem.Q(path[i])+=result;
     }
     print_path(path, num_path);
   }
   
-  int get_pathitems(TreeNode** path, int num_path, int *items) {
+  int get_pathitems(int* path, int num_path, int *items) {
     int num_items=0;
     for (int i=0; i<num_path; i++) {
-      if (path[i]->item >=0 ) { // root node has item=-1, exclude this
-        items[num_items]=path[i]->item;
+      if (treeMem.item(path[i]) >=0 ) { // root node has item=-1, exclude this
+        items[num_items]=treeMem.item(path[i]);
         num_items++;
       }
     }
     return num_items;
   }
   
-  void print_path(TreeNode** path, int num_path) {
+  void print_path(int* path, int num_path) {
     for (int i=0; i<num_path; i++) {
-      DEBUG_PRINT("item %d, Q=%g, N=%d\n",path[i]->item, path[i]->Q, path[i]->N);
-      //printf("item %d, Q=%g, N=%d\n",path[i]->item, path[i]->Q, path[i]->N);
+      DEBUG_PRINT("item %d, Q=%g, N=%d\n",treeMem.item(path[i]), treeMem.Q(path[i]), treeMem.N(path[i]));
     }
   }
   
-  void print_tree(TreeNode* node, std::vector<int> path) {
+  void print_tree(int node, std::vector<int> path) {
     for (auto &p : path) {
       printf("%d:",p);
     }
-    printf("%d (Q,N) %g/%d\n",node->item,node->Q,node->N);
+    printf("%d (Q,N) %g/%d\n",treeMem.item(node),treeMem.Q(node),treeMem.N(node));
     std::vector<int> path2(path);
-    path2.push_back(node->item);
-    for (int i=0; i<node->child_size;i++) {
-      print_tree(node->child[i], path2);
+    path2.push_back(treeMem.item(node));
+    int first=treeMem.first_child(node);
+    for (int i=first; i<first+treeMem.child_size(node);i++) {
+      print_tree(i, path2);
     }
   }
   
@@ -193,26 +279,39 @@ public:
     DEBUG_PRINT("\n");
   }
   
-  void run(Groups *groups, double* probs, int* used_items, int* used_items_list, double* used_ratings, int num_used_items, int max_count, int num_rollouts, int max_lookahead, int max_num_rollout_items, bool use_montecarlo) {
+  void run(Groups *groups, const Posterior* post, int* used_items, int num_used_items, int max_count, int num_rollouts, int max_lookahead, int max_num_rollout_items, bool use_montecarlo) {
+    run_with(&rng, &unused, groups, post, used_items, num_used_items, max_count, num_rollouts, max_lookahead, max_num_rollout_items, use_montecarlo);
+  }
+  
+  void run_with(Rng *rng, UnusedItems *pool, Groups *groups, const Posterior* post, int* used_items, int num_used_items, int max_count, int num_rollouts, int max_lookahead, int max_num_rollout_items, bool use_montecarlo) {
+    // one simulation, drawing random numbers from rng and rollout items from pool.  safe to
+    // call from several threads at once when shared is set, as long as each thread has its
+    // own rng and pool
     //auto start = std::chrono::steady_clock::now();
     //DEBUG_PRINT("run num_items %d, num_used_items %d:\n",groups->num_items,num_used_items); print_itemarray(used_items,groups->num_items);
-    double cumsum_probs[MAX_NUM_GROUPS];
-    cumsum_probs[0]=probs[0];
-    for (int g=1; g<groups->num_groups; g++){
-      cumsum_probs[g]=cumsum_probs[g-1]+probs[g];
-      //printf("%g ",cumsum_probs[g]);
-    }
-    //printf("\n");
-    
-    TreeNode* path[max_count];
+    int path[max_count];
     int num_path=0;
-    num_path = select(path);
+    num_path = select(path, rng, groups->num_items, used_items);
     //DEBUG_PRINT("selected path\n"); print_path(path,num_path);
-    TreeNode *leaf_node = path[num_path-1];
-    if ((leaf_node->item<0) || ((leaf_node->N>0) && (leaf_node->child_size==0) && (num_path<max_lookahead+1)) ) { // already visited, now expand
-      expand(leaf_node,path,num_path,groups->num_items,used_items);
-      if (leaf_node->child_size > 0) {
-        leaf_node = UCB(leaf_node);
+    int leaf_node = path[num_path-1];
+    // don't count our own virtual loss as a visit
+    int leaf_N = treeMem.N(leaf_node) - ((shared && num_path>1) ? virtual_loss : 0);
+    if ((treeMem.item(leaf_node)<0) || ((leaf_N>0) && (treeMem.child_size(leaf_node)==0) && (num_path<max_lookahead+1)) ) { // already visited, now expand
+      if (widening()) {
+        widen(&treeMem,leaf_node,path,num_path,groups->num_items,used_items,candidates,num_candidates,widen_target(leaf_node));
+      } else if (shared) {
+        expand_once(&treeMem,leaf_node,path,num_path,groups->num_items,used_items,candidates,num_candidates);
+      } else {
+        expand(&treeMem,leaf_node,path,num_path,groups->num_items,used_items,candidates,num_candidates);
+      }
+      if (treeMem.full && leaf_N > prune_N) {
+        prune_N = leaf_N;
+      }
+      if (__atomic_load_n(&treeMem.child_size(leaf_node), __ATOMIC_ACQUIRE) > 0) {
+        leaf_node = UCB(leaf_node, rng);
+        if (shared) {
+          atomic_add(&treeMem.N(leaf_node), virtual_loss);
+        }
         path[num_path]=leaf_node; num_path++;
       } 
       //DEBUG_PRINT("expanded, num_path=%d\n",num_path); print_path(path,num_path);
@@ -224,91 +323,223 @@ public:
     double reward=0.0;
     if (use_montecarlo) {
       // sample ratings and estimate average
-      int tmp_used_items[groups->num_items];
-      memcpy(tmp_used_items, used_items, groups->num_items*sizeof(int));
-      for (int i=0; i<num_path_items; i++) { //get_pathitems() already excludes root node
   #ifdef DEBUG_MEM
-        if (path_items[i]<0 || path_items[i]>MAX_BRANCHING-1) {
-          printf("ERROR: In run() tmp_used_items item %d is out of range",path_items[i]);
+      for (int i=0; i<num_path_items; i++) { //get_pathitems() already excludes root node
+        if (path_items[i]<0 || path_items[i]>groups->num_items-1) {
+          printf("ERROR: In run() path item %d is out of range",path_items[i]);
           exit(1);
         }
+      }
   #endif
-        tmp_used_items[path_items[i]]=1;
+      // rollouts fill up the items still to be asked about, at most max_num_rollout_items of them
+      int rollout_count = max_count-(num_used_items+num_path_items);
+      if (rollout_count > max_num_rollout_items) {
+        rollout_count = max_num_rollout_items;
       }
-      // a small optimisation, take repeated calc outside rollout for loop ...
-      double init_err[MAX_NUM_GROUPS]={};
-      groups->init_reward_err(used_items_list, used_ratings, num_used_items, init_err);
-      
-      for (int i=0; i<num_rollouts*groups->num_groups; i++) {
+      // gather all the rollouts for this leaf first, drawing the random numbers in the same
+      // order as evaluating them one at a time would, then evaluate them as one batch
+      int num_batch = num_rollouts*groups->num_groups;
+      static thread_local RolloutBatch batch;
+      batch.resize(num_batch, max_count);
+      for (int i=0; i<num_batch; i++) {
         //DEBUG_PRINT("rollout %d\n",i);
-        int rollout_items[max_count], num_rollout_items=0;
+        int* rollout_items = &batch.items[(size_t)i*max_count];
+        int num_rollout_items=0;
         if (max_num_rollout_items>0) {
-          num_rollout_items = rollout(groups, tmp_used_items, num_used_items+num_path_items, max_count, rollout_items);
-
           // int num_total_used = num_used_items+num_path_items;
           // int num_roll_items = fmax(5 - num_total_used, max_num_rollout_items);
-          // if (num_rollout_items > num_roll_items) {
-          //   num_rollout_items = num_roll_items;
-          // }
-
-          if (num_rollout_items > max_num_rollout_items) {
-            num_rollout_items = max_num_rollout_items;
-          }
+          num_rollout_items = rollout(pool, path_items, num_path_items, rollout_count, rollout_items, rng);
         }
         // we don't know the true user group, so calc rollout for all groups and take average reward
         // -- weight groups non-uniformly for now, but could change that?
-        double r=uniform_rnd();
+        double r=rng->uniform();
         int g;
         for (g=0; g<groups->num_groups; g++){
-          if (r <= cumsum_probs[g]) break;
+          if (r <= post->cumsum[g]) break;
+        }
+        batch.num_items[i] = num_rollout_items;
+        batch.group[i] = g;
+        // standard normals for the ratings of the path items followed by the rollout items
+        double* z = &batch.z[(size_t)i*max_count];
+        for (int k=0; k<num_path_items+num_rollout_items; k++) {
+          z[k] = rng->normal();
         }
-        reward += groups->reward(g, path_items, num_path_items, rollout_items, num_rollout_items, init_err);
-        // reward += groups->discounted_reward(g, path_items, num_path_items, rollout_items, num_rollout_items, init_err);
-        // reward += groups->discounted_reward(g, path_items, num_path_items, used_items_list, num_used_items, rollout_items, num_rollout_items);
       }
+      reward = groups->reward_batch(num_batch, batch.group.data(), path_items, num_path_items, batch.items.data(), batch.num_items.data(), max_count, batch.z.data(), post->err.data(), leaf_threads);
+      // reward += groups->discounted_reward(g, path_items, num_path_items, rollout_items, num_rollout_items, init_err, rng);
       reward = reward/(num_rollouts*groups->num_groups);
     } else {
       // use mean rating instead of sampling.
-      int tmp_used_items_list[num_used_items+1];
-      memcpy(tmp_used_items_list, used_items_list, num_used_items*sizeof(int));
-      tmp_used_items_list[num_used_items]=path_items[0];
-      double tmp_ratings[num_used_items+1];
-      memcpy(tmp_ratings,used_ratings,num_used_items*sizeof(double));
       for (int g=0; g<groups->num_groups; g++) {
         // one-step ahead only for now i.e. num_path_items=1 and no rollout items
-        tmp_ratings[num_used_items]=groups->mean_rating(g, path_items[0]);
-        double tmp_groupprobs[MAX_NUM_GROUPS];
-        groups->calc_group_probs(tmp_used_items_list, tmp_ratings, num_used_items+1, tmp_groupprobs);
-        reward += probs[g]*tmp_groupprobs[g];
+        double tmp_groupprobs[groups->num_groups];
+        post->probs_with(path_items[0], groups->mean_rating(g, path_items[0]), tmp_groupprobs);
+        reward += post->probs[g]*tmp_groupprobs[g];
       }
     }
     //printf("time %g/%g\n",std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start2).count(), std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
     //DEBUG_PRINT("reward %g\n",reward);
     backpropagate(reward, path, num_path);
     //DEBUG_PRINT("backpropagated\n");
+    if (treeMem.full && !shared) {
+      // hit the memory cap, make room for the next expansions.  shared trees just stop expanding
+      prune(prune_N);
+      prune_N=0;
+    }
     
   }
   
-  void reset() {
-    if (root!=nullptr) {
+  int reroot(int item, double discount) {
+    // make the root's child for item the new root, keeping its subtree for the next
+    // question.  the subtree is copied breadth first into spareMem, which then becomes
+    // treeMem, so each sibling range stays contiguous and the old nodes are all freed.
+    // the old stats were gathered before item's rating was known and with the old group
+    // probabilities, so N and Q are scaled down by discount (Q/N is kept).  returns the
+    // visit count of the new root
+    int child=-1;
+    int first=treeMem.first_child(root);
+    for (int i=first; i<first+treeMem.child_size(root); i++) {
+      if (treeMem.item(i) == item) {
+        child=i;
+        break;
+      }
+    }
+    if (child<0) {
+      reset();
+      return 0;
+    }
+    free_allTreeNodes(&spareMem);
+    // both stores hold memory until the swap, so the copy only gets what the old tree leaves
+    // of the cap (at least its first block, max_bytes=1 still caps it)
+    size_t cap=treeMem.max_bytes;
+    spareMem.max_bytes = cap > 0 ? (cap > treeMem.bytes()+1 ? cap-treeMem.bytes() : 1) : 0;
+    spareMem.reserve(1<<treeMem.block_bits);
+    int new_root = alloc_TreeNodes(&spareMem,1);
+    std::vector<std::pair<int,int>> queue; // (old node, new node) pairs still to copy
+    queue.push_back({child,new_root});
+    for (size_t q=0; q<queue.size(); q++) {
+      int from=queue[q].first, to=queue[q].second;
+      int N=treeMem.N(from);
+      int new_N=(int)(N*discount+0.5);
+      spareMem.N(to)=new_N;
+      spareMem.Q(to)=N>0 ? treeMem.Q(from)*new_N/N : 0;
+      spareMem.item(to)=treeMem.item(from);
+      int size=treeMem.child_size(from);
+      spareMem.child_size(to)=size;
+      spareMem.state(to)=size>0 ? NODE_EXPANDED : NODE_LEAF;
+      spareMem.child_cap(to)=size;
+      spareMem.widen(to)=0; // the candidate list is redone for the next question
+      int new_first = size>0 ? alloc_TreeNodes(&spareMem,size) : -1;
+      if (new_first<0) {
+        // no children, or no room for them under the memory cap
+        spareMem.child_size(to)=0;
+        spareMem.child_cap(to)=0;
+        spareMem.state(to)=NODE_LEAF;
+      } else {
+        spareMem.first_child(to)=new_first;
+        for (int i=0; i<size; i++) {
+          queue.push_back({treeMem.first_child(from)+i,new_first+i});
+        }
+      }
+    }
+    spareMem.item(new_root)=-1; // mark node as root
+    note_bytes();
+    treeMem.swap(spareMem);
+    treeMem.max_bytes=cap;
+    spareMem.max_bytes=cap;
+    root=new_root;
+    prune_N=0; prune_floor=0;
+    free_allTreeNodes(&spareMem);
+    if (spareMem.max_bytes > 0) {
+      // with a cap only the kept tree holds memory between questions
+      spareMem.release();
+    }
+    return treeMem.N(root);
+  }
+
+  inline size_t bytes() const {
+    return treeMem.bytes()+spareMem.bytes();
+  }
+
+  inline void note_bytes() {
+    size_t b = bytes();
+    peak_bytes = b > peak_bytes ? b : peak_bytes;
+  }
+
+  int free_subtree(int node) {
+    // frees all the descendants of node, which becomes a leaf.  returns the number of nodes freed
+    int size = treeMem.child_size(node);
+    if (size == 0) {
+      return 0;
+    }
+    int first = treeMem.first_child(node);
+    int freed = 0;
+    for (int i=first; i<first+size; i++) {
+      freed += free_subtree(i);
+    }
+    free_TreeNodes(&treeMem, first, treeMem.child_cap(node));
+    freed += treeMem.child_cap(node);
+    treeMem.child_size(node)=0;
+    treeMem.child_cap(node)=0;
+    treeMem.widen(node)=0;
+    treeMem.state(node)=NODE_LEAF;
+    return freed;
+  }
+
+  int prune(int min_N) {
+    // called when the node memory is full and a node visited min_N times couldn't get
+    // children: frees the subtrees under the least visited nodes below the root, as long as
+    // they have fewer than min_N visits, until half the nodes in use are free again.  so a
+    // busy node can take the place of quiet ones but nodes visited about as often don't keep
+    // evicting each other, instead the search stops expanding them.  the pruned nodes keep
+    // their stats and get expanded afresh if the search comes back to them.  the root's
+    // children are always kept, they decide the answer.  returns the number of nodes freed
+    treeMem.full=false;
+    if (min_N <= prune_floor) {
+      return 0; // nothing to gain, skip the scan
+    }
+    std::vector<std::pair<int,int>> nodes; // (node, depth) of the expanded nodes below the root
+    std::vector<std::pair<int,int>> queue = {{root,0}};
+    for (size_t q=0; q<queue.size(); q++) {
+      int node=queue[q].first, depth=queue[q].second;
+      int first=treeMem.first_child(node);
+      for (int i=first; i<first+treeMem.child_size(node); i++) {
+        if (treeMem.child_size(i)>0) {
+          nodes.push_back({i,depth+1});
+          queue.push_back({i,depth+1});
+        }
+      }
+    }
+    // fewest visits first, and deeper first on ties so a subtree is freed before its parent
+    std::sort(nodes.begin(), nodes.end(), [this](const std::pair<int,int>& a, const std::pair<int,int>& b) {
+      int Na=treeMem.N(a.first), Nb=treeMem.N(b.first);
+      return Na < Nb || (Na == Nb && a.second > b.second);
+    });
+    int target = treeMem.nodes_in_use/2, freed = 0;
+    size_t i=0;
+    for (; i<nodes.size() && freed<target && treeMem.N(nodes[i].first)<min_N; i++) {
+      freed += free_subtree(nodes[i].first);
+    }
+    prune_floor = i<nodes.size() ? treeMem.N(nodes[i].first) : INT_MAX;
+    DEBUG_PRINT("pruned %d nodes, %d in use\n",freed,treeMem.nodes_in_use);
+    return freed;
+  }
+
+  void reset(int max_children=0) {
+    // max_children is the largest number of children a node can have i.e. the number of items
+    if (root>=0) {
       // throw away old tree
       free_allTreeNodes(&treeMem);
-      root=nullptr;
+      root=-1;
     }
-    root = alloc_TreeNode(&treeMem);
-    root->item=-1; // mark node as root
-    root->child_size=0;
-    root->N=0; root->Q=0; //root->Q2=0;
-    //srand((unsigned int)time(NULL));
-#ifdef USE_GSL
-    const gsl_rng_type *T;
-    gsl_rng_env_setup();
-    //T = gsl_rng_default;
-    T = gsl_rng_taus2; // slightly faster than mersenne twister
-    gen = gsl_rng_alloc(T);
-    gsl_rng_set(gen, (unsigned long)time(NULL));
-#endif
-    
+    treeMem.reserve(max_children);
+    root = alloc_TreeNodes(&treeMem,1);
+    treeMem.item(root)=-1; // mark node as root
+    prune_N=0; prune_floor=0;
+    treeMem.child_size(root)=0;
+    treeMem.state(root)=NODE_LEAF;
+    treeMem.child_cap(root)=0; treeMem.widen(root)=0;
+    treeMem.N(root)=0; treeMem.Q(root)=0;
   }
   
 };
@@ -0,0 +1,140 @@
+#pragma once
+
+// Binary model files.  A model file holds the per-group item rating means and variances in
+// the item-major, padded layout used by Groups (see Groups.h), together with the derived
+// arrays, so loading one is just an mmap: no parsing, and every process using the same
+// file shares one copy of it in the page cache.  Convert the csv files with csv2model.
+//
+// layout: a 64 byte ModelHeader, then the arrays mu, sigma2, 1/sigma2, log(sqrt(sigma2))
+// and sqrt(sigma2), each num_items*group_stride values starting on a 64 byte boundary.
+// group_stride must be simd_pad(num_groups), the SIMD kernels read whole padded rows.
+// the checksum is FNV-1a over everything after the header.  checking it reads the whole
+// file, so load_model() only does that when asked to.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "Groups.h"
+#include "simd.h"
+
+#define MODEL_MAGIC "MCTSMODL"
+#define MODEL_VERSION 1
+#define MODEL_DTYPE_F64 1 // values are little endian doubles
+#define MODEL_NUM_ARRAYS 5
+
+struct ModelHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  int32_t num_groups;
+  int32_t num_items;
+  int32_t group_stride;
+  uint32_t reserved;
+  uint64_t array_bytes; // size of each array, a multiple of SIMD_ALIGN
+  uint64_t data_bytes; // everything after the header
+  uint64_t checksum;
+  uint64_t reserved2;
+};
+static_assert(sizeof(ModelHeader) == SIMD_ALIGN, "model header must keep the arrays aligned");
+
+inline uint64_t fnv1a(const unsigned char* data, size_t n) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i=0; i<n; i++) {
+    h = (h^data[i])*1099511628211ULL;
+  }
+  return h;
+}
+
+inline void write_model(const char* fname, Groups* groups) {
+  size_t n = (size_t)groups->num_items*groups->group_stride;
+  size_t array_bytes = (n*sizeof(double)+SIMD_ALIGN-1)/SIMD_ALIGN*SIMD_ALIGN;
+  const double* arrays[MODEL_NUM_ARRAYS] = {groups->mu_t, groups->sigma2_t, groups->inv_sigma2_t, groups->log_sigma_t, groups->sigma_t};
+  std::vector<unsigned char> data(MODEL_NUM_ARRAYS*array_bytes, 0);
+  for (int a=0; a<MODEL_NUM_ARRAYS; a++) {
+    memcpy(&data[a*array_bytes], arrays[a], n*sizeof(double));
+  }
+  ModelHeader h = {};
+  memcpy(h.magic, MODEL_MAGIC, sizeof(h.magic));
+  h.version = MODEL_VERSION;
+  h.dtype = MODEL_DTYPE_F64;
+  h.num_groups = groups->num_groups;
+  h.num_items = groups->num_items;
+  h.group_stride = groups->group_stride;
+  h.array_bytes = array_bytes;
+  h.data_bytes = data.size();
+  h.checksum = fnv1a(data.data(), data.size());
+  FILE* f = fopen(fname, "wb");
+  if (f == nullptr) {
+    char str[FILENAME_MAX];
+    snprintf(str,FILENAME_MAX,"ERROR: Can't open file %s\n",fname);
+    perror(str);
+    exit(1);
+  }
+  if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(data.data(), 1, data.size(), f) != data.size() || fclose(f) != 0) {
+    printf("ERROR: failed writing model file %s\n",fname);
+    exit(1);
+  }
+}
+
+inline void load_model(const char* fname, Groups* groups, bool verify=false) {
+  // maps the file read-only and points groups at the arrays in it.  the mapping is kept
+  // for the life of the process.  the header is always checked, and with verify the
+  // checksum of the data too (which pages in the whole file)
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {
+    char str[FILENAME_MAX];
+    snprintf(str,FILENAME_MAX,"ERROR: Can't open file %s\n",fname);
+    perror(str);
+    exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ModelHeader)) {
+    printf("ERROR: %s is too short to be a model file\n",fname);
+    exit(1);
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("ERROR: mmap of model file failed");
+    exit(1);
+  }
+  const ModelHeader* h = (const ModelHeader*)map;
+  const unsigned char* data = (const unsigned char*)map+sizeof(ModelHeader);
+  if (memcmp(h->magic, MODEL_MAGIC, sizeof(h->magic)) != 0) {
+    printf("ERROR: %s is not a model file\n",fname);
+    exit(1);
+  }
+  if (h->version != MODEL_VERSION || h->dtype != MODEL_DTYPE_F64) {
+    printf("ERROR: %s has model version %u dtype %u, expected version %d dtype %d\n",fname,h->version,h->dtype,MODEL_VERSION,MODEL_DTYPE_F64);
+    exit(1);
+  }
+  bool shape_ok = h->num_groups>=1 && h->num_groups<=INT32_MAX-SIMD_GROUP_PAD && h->num_items>=1;
+  // the padded stride and array size write_model() uses for this shape
+  int stride = shape_ok ? simd_pad(h->num_groups) : 0;
+  uint64_t padded_bytes = ((uint64_t)h->num_items*stride*sizeof(double)+SIMD_ALIGN-1)/SIMD_ALIGN*SIMD_ALIGN;
+  if (!shape_ok || h->group_stride != stride || h->array_bytes != padded_bytes
+      || h->data_bytes != MODEL_NUM_ARRAYS*h->array_bytes || (uint64_t)st.st_size != sizeof(ModelHeader)+h->data_bytes) {
+    printf("ERROR: %s has an inconsistent header (num groups %d, group stride %d, num items %d)\n",fname,h->num_groups,h->group_stride,h->num_items);
+    exit(1);
+  }
+  if (verify && fnv1a(data, h->data_bytes) != h->checksum) {
+    printf("ERROR: checksum mismatch in %s, file is corrupt\n",fname);
+    exit(1);
+  }
+  groups->num_groups = h->num_groups;
+  groups->num_items = h->num_items;
+  groups->group_stride = h->group_stride;
+  groups->mu = nullptr;
+  groups->sigma2 = nullptr;
+  groups->mu_t = (double*)(data);
+  groups->sigma2_t = (double*)(data+h->array_bytes);
+  groups->inv_sigma2_t = (double*)(data+2*h->array_bytes);
+  groups->log_sigma_t = (double*)(data+3*h->array_bytes);
+  groups->sigma_t = (double*)(data+4*h->array_bytes);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+// Posterior over the user groups for one session, given the ratings received so far.
+// The per-group sums that calc_group_probs() would rebuild from all the rated items are
+// kept here and updated in O(num_groups) as each new rating comes in, so the searches
+// just read err[] (the initial reward error) and cumsum[] without any rescanning.
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "Groups.h"
+#include "simd.h"
+
+class Posterior {
+public:
+  Groups* groups;
+  int num_ratings;
+  // sums over the rated items of (r-mu)^2/sigma2 and of log(sqrt(sigma2)), both padded to
+  // group_stride entries
+  std::vector<double> err, log_norm;
+  std::vector<double> probs;
+  std::vector<double> cumsum; // cumulative probs, for sampling a group
+
+  Posterior(Groups* groups) : groups(groups), err(groups->group_stride), log_norm(groups->group_stride),
+    probs(groups->num_groups), cumsum(groups->num_groups) {
+    reset();
+  }
+
+  void reset() {
+    // back to no ratings i.e. a uniform prior
+    num_ratings=0;
+    std::fill(err.begin(), err.end(), 0.0);
+    std::fill(log_norm.begin(), log_norm.end(), 0.0);
+    update_probs();
+  }
+
+  void add_rating(int item, double r) {
+    groups->add_err(item, r, err.data());
+    const double* ls = groups->log_sigma_t+(size_t)item*groups->group_stride;
+    for (int g=0; g<groups->group_stride; g++) {
+      log_norm[g] += ls[g];
+    }
+    num_ratings++;
+    update_probs();
+  }
+
+  void probs_with(int item, double r, double* out) const {
+    // the group probs there would be after one more rating, without changing the posterior
+    double tmp_err[groups->group_stride];
+    memcpy(tmp_err, err.data(), groups->group_stride*sizeof(double));
+    groups->add_err(item, r, tmp_err);
+    const double* ls = groups->log_sigma_t+(size_t)item*groups->group_stride;
+    double tmp_log_norm[groups->group_stride];
+    for (int g=0; g<groups->group_stride; g++) {
+      tmp_log_norm[g] = log_norm[g]+ls[g];
+    }
+    group_probs(tmp_err, tmp_log_norm, groups->num_groups, out);
+  }
+
+  int estimated_group() const {
+    int best_group=0;
+    double max=probs[0];
+    for (int g=1; g<groups->num_groups; g++) {
+      if (probs[g]>max) {
+        max=probs[g];
+        best_group=g;
+      }
+    }
+    return best_group;
+  }
+
+private:
+  void update_probs() {
+    group_probs(err.data(), log_norm.data(), groups->num_groups, probs.data());
+    cumsum[0]=probs[0];
+    for (int g=1; g<groups->num_groups; g++) {
+      cumsum[g]=cumsum[g-1]+probs[g];
+    }
+  }
+};
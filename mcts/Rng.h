@@ -0,0 +1,215 @@
+#pragma once
+
+// Per-thread random number generation.  Each Rng is a Philox4x32-10 counter-based
+// generator (Salmon et al, "Parallel random numbers: as easy as 1, 2, 3", SC'11) keyed by
+// an explicit seed and stream id, so every tree/thread gets its own independent stream
+// with no shared state between threads, and a run is reproducible for a given seed.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+#include "simd.h"
+
+#define USE_GSL 1
+#ifdef USE_GSL
+// GNU Scientific Library - install using "brew install gsl".  only used to benchmark against now.
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+#endif
+
+class Philox4x32 {
+public:
+  typedef uint32_t result_type;
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xffffffffu; }
+
+  void seed(uint64_t seed, uint64_t stream) {
+    // the key holds the seed, the top half of the counter holds the stream id and the
+    // bottom half counts blocks of 4 outputs within the stream
+    key[0] = (uint32_t)seed; key[1] = (uint32_t)(seed>>32);
+    ctr[0] = 0; ctr[1] = 0;
+    ctr[2] = (uint32_t)stream; ctr[3] = (uint32_t)(stream>>32);
+    posn = 4;
+  }
+
+  void fill(uint32_t* dst, int n) {
+    // n (a multiple of 4) fresh outputs, a block at a time. written so the loop vectorises
+    uint64_t base = ((uint64_t)ctr[1]<<32) | ctr[0];
+    for (int j=0; j<n/4; j++) {
+      uint64_t count = base+j;
+      uint32_t c[4] = {(uint32_t)count, (uint32_t)(count>>32), ctr[2], ctr[3]};
+      round10(c);
+      dst[4*j] = c[0]; dst[4*j+1] = c[1]; dst[4*j+2] = c[2]; dst[4*j+3] = c[3];
+    }
+    base += n/4;
+    ctr[0] = (uint32_t)base; ctr[1] = (uint32_t)(base>>32);
+  }
+
+  inline result_type operator()() {
+    if (posn == 4) {
+      generate();
+      posn = 0;
+    }
+    return out[posn++];
+  }
+
+private:
+  uint32_t ctr[4] = {}, key[2] = {}, out[4] = {};
+  int posn = 4;
+
+  inline void round10(uint32_t* c) const {
+    uint32_t k[2] = {key[0], key[1]};
+    for (int round=0; round<10; round++) {
+      uint64_t p0 = (uint64_t)0xD2511F53u*c[0];
+      uint64_t p1 = (uint64_t)0xCD9E8D57u*c[2];
+      uint32_t c0 = (uint32_t)(p1>>32)^c[1]^k[0];
+      uint32_t c2 = (uint32_t)(p0>>32)^c[3]^k[1];
+      c[1] = (uint32_t)p1; c[3] = (uint32_t)p0;
+      c[0] = c0; c[2] = c2;
+      k[0] += 0x9E3779B9u; k[1] += 0xBB67AE85u;
+    }
+  }
+
+  void generate() {
+    uint32_t c[4] = {ctr[0], ctr[1], ctr[2], ctr[3]};
+    round10(c);
+    out[0] = c[0]; out[1] = c[1]; out[2] = c[2]; out[3] = c[3];
+    if (++ctr[0] == 0) {
+      ++ctr[1];
+    }
+  }
+};
+
+// standard normals are generated RNG_BATCH at a time by the vectorised Box-Muller kernel
+// and then handed out one by one
+#define RNG_BATCH 256
+
+class Rng {
+public:
+  Philox4x32 eng;
+
+  Rng(uint64_t seed=0, uint64_t stream=0) {
+    this->seed(seed, stream);
+  }
+  // copies would silently share a stream
+  Rng(const Rng&) = delete;
+  Rng& operator=(const Rng&) = delete;
+
+  void seed(uint64_t seed, uint64_t stream) {
+    eng.seed(seed, stream);
+    normal_posn = RNG_BATCH;
+  }
+
+  inline double uniform() {
+    // in [0,1)
+    return eng()*(1.0/4294967296.0);
+  }
+
+  inline uint32_t below(uint32_t n) {
+    // uniform integer in [0,n), n>0.  Lemire's multiply and shift, with the rejection step that
+    // removes the bias, so unlike rounding a uniform every value is equally likely
+    uint64_t m = (uint64_t)eng()*n;
+    if ((uint32_t)m < n) {
+      uint32_t t = (0u-n)%n;
+      while ((uint32_t)m < t) {
+        m = (uint64_t)eng()*n;
+      }
+    }
+    return (uint32_t)(m>>32);
+  }
+
+  inline double normal() {
+    if (normal_posn == RNG_BATCH) {
+      refill_normals();
+    }
+    return normals[normal_posn++];
+  }
+
+  inline double gaussian(double sigma) {
+    return normal()*sigma;
+  }
+
+private:
+  alignas(SIMD_ALIGN) double normals[RNG_BATCH];
+  int normal_posn = RNG_BATCH;
+
+  void refill_normals() {
+    alignas(SIMD_ALIGN) uint32_t bits[RNG_BATCH];
+    eng.fill(bits, RNG_BATCH);
+    gaussian_batch(bits, RNG_BATCH/2, normals);
+    normal_posn = 0;
+  }
+};
+
+inline int rng_selftest(uint64_t seed) {
+  // statistical checks on the normal generator, returns number of failed checks.
+  // each check allows 5 standard errors, so a correct generator essentially never fails.
+  const int n = 10000000;
+  Rng rng(seed, 0), rng2(seed, 1);
+  const int num_bins = 42; // 40 bins of width 0.2 over [-4,4] plus the two tails
+  double counts[num_bins] = {};
+  double sum=0, sum2=0, sum3=0, sum4=0, lag=0, cross=0, prev=0;
+  for (int i=0; i<n; i++) {
+    double z = rng.normal();
+    double z2 = rng2.normal();
+    sum += z; sum2 += z*z; sum3 += z*z*z; sum4 += z*z*z*z;
+    lag += z*prev; prev = z;
+    cross += z*z2;
+    int bin = (int)floor((z+4.0)/0.2)+1;
+    bin = bin < 0 ? 0 : (bin > num_bins-1 ? num_bins-1 : bin);
+    counts[bin]++;
+  }
+  double mean = sum/n, var = sum2/n-mean*mean;
+  double skew = sum3/n, kurt = sum4/n-3.0;
+  double chi2 = 0;
+  for (int b=0; b<num_bins; b++) {
+    double lo = b==0 ? -INFINITY : -4.0+0.2*(b-1);
+    double hi = b==num_bins-1 ? INFINITY : -4.0+0.2*b;
+    double expected = n*0.5*(erfc(-hi/sqrt(2.0))-erfc(-lo/sqrt(2.0)));
+    chi2 += (counts[b]-expected)*(counts[b]-expected)/expected;
+  }
+  int df = num_bins-1;
+  struct { const char* name; double val, limit; } checks[] = {
+    {"mean", fabs(mean), 5/sqrt(n)},
+    {"variance-1", fabs(var-1), 5*sqrt(2.0/n)},
+    {"skewness", fabs(skew), 5*sqrt(6.0/n)},
+    {"excess kurtosis", fabs(kurt), 5*sqrt(24.0/n)},
+    {"lag-1 correlation", fabs(lag/n), 5/sqrt(n)},
+    {"correlation between streams", fabs(cross/n), 5/sqrt(n)},
+    {"chi2 histogram", chi2, df+5*sqrt(2.0*df)},
+  };
+  int failed = 0;
+  printf("gaussian self-test, %d samples:\n", n);
+  for (auto &c : checks) {
+    bool ok = c.val <= c.limit;
+    printf("  %-28s %10.3g (limit %.3g) %s\n", c.name, c.val, c.limit, ok ? "ok" : "FAILED");
+    failed += !ok;
+  }
+  return failed;
+}
+
+inline void rng_benchmark(uint64_t seed) {
+  // compare the batched generator with the previous gsl taus2+ziggurat path
+  const int n = 50000000;
+  double sum = 0;
+  Rng rng(seed, 0);
+  auto start = std::chrono::steady_clock::now();
+  for (int i=0; i<n; i++) {
+    sum += rng.normal();
+  }
+  double t_batch = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()/n;
+  printf("gaussian benchmark (%s): batched philox box-muller %.2f ns/sample\n", simd_names[simd_level], t_batch);
+#ifdef USE_GSL
+  gsl_rng *gen = gsl_rng_alloc(gsl_rng_taus2);
+  gsl_rng_set(gen, (unsigned long)seed);
+  start = std::chrono::steady_clock::now();
+  for (int i=0; i<n; i++) {
+    sum += gsl_ran_gaussian_ziggurat(gen, 1.0);
+  }
+  double t_gsl = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()/n;
+  gsl_rng_free(gen);
+  printf("gaussian benchmark: gsl taus2 ziggurat %.2f ns/sample, speedup %.2fx\n", t_gsl, t_gsl/t_batch);
+#endif
+  printf("(checksum %g)\n", sum);
+}
@@ -0,0 +1,466 @@
+#pragma once
+
+// Runs the MCTS simulations for one question and picks the next item to ask about.
+// With root_threads>1 the search is root parallel: each thread builds its own independent
+// tree for the same state using its own random stream, and the root child statistics of
+// the trees are summed before choosing the item.  With tree_threads>1 the search is tree
+// parallel instead: the threads all run simulations on one shared tree, using atomic
+// updates of the node stats and virtual loss to spread out over different children.
+// With a deadline the search is anytime: it stops when the deadline hits, even part way
+// through the simulation count, and answers with the best child found so far.
+// After a question, advance() can keep the subtree under the chosen item as the tree for
+// the next question (single tree searches only), so its simulations count towards the
+// next budget.  Independently of all this, leaf_threads>1 evaluates the batch of rollouts
+// made from each leaf in parallel (leaf parallel), if it is big enough to pay for the
+// threads.  With num_candidates>0 only the items that best separate the groups under the
+// current posterior are put in the tree, and with widen_alpha>0 the nodes below the root
+// only get children as their visits grow (progressive widening).
+// With stop_z set the search can end before the simulation count, once the best root child
+// is clearly ahead or has stayed in front for a while, see EarlyStop.
+// With max_tree_bytes set each tree stays under that much node memory, pruning its least
+// visited subtrees when it fills up.
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "MCTS.h"
+#include "Groups.h"
+#include "Posterior.h"
+
+struct SearchConfig {
+  int max_count=25; // number of items to ask user to rate
+  int num_rollouts=1;
+  int max_lookahead=1;
+  int max_num_rollouts=0;
+  bool use_montecarlo=true;
+  double time_limit=0.0; // in milliseconds, keep simulating until at least this long
+  double deadline=0.0; // in milliseconds, if >0 stop at this point even if the count isn't reached
+  int root_threads=1; // number of independent trees per question
+  int tree_threads=1; // number of threads sharing one tree
+  int virtual_loss=1; // visits added to a node while a thread's simulation through it is in flight
+  int leaf_threads=1; // number of threads evaluating the batch of rollouts for each leaf
+  double reuse_discount=0.0; // if >0 keep the chosen subtree, scaling its stats by this
+  int num_candidates=0; // if >0 only this many of the most discriminating items go in the tree
+  double widen_alpha=0.0; // if >0 nodes below the root get ceil(N^widen_alpha) children (progressive widening)
+  double stop_z=0.0; // if >0 stop early once the leading root child is this many standard errors clear of the rest
+  double stop_min_frac=0.1; // with stop_z, always run at least this fraction of the simulation count
+  int stop_stable=0; // with stop_z, also stop once the leader has stayed the same for this many checks (0 for never)
+  size_t max_tree_bytes=0; // if >0 cap on the node memory of each tree, low visit subtrees are pruned to stay under it
+};
+
+struct SearchResult {
+  int item; // next item to ask about
+  int num_sims; // total number of simulations over all trees
+  double time_ms;
+  bool deadline_hit; // stopped by the deadline before the simulation count was reached
+  int budget; // simulation count asked for
+  int stop_reason; // STOP_* (for root parallel searches, the reason the first tree stopped)
+};
+
+// why a search stopped: it used the whole budget, hit the deadline, the leading root child
+// was statistically separated from the others, or the leader didn't change for a while
+enum { STOP_BUDGET=0, STOP_DEADLINE, STOP_SEPARATED, STOP_STABLE, NUM_STOP_REASONS };
+inline const char* stop_names[] = {"budget", "deadline", "separated", "stable"};
+
+// early stopping looks at the root children every 1/STOP_CHECKS of the budget (but at least
+// every STOP_CHECK_SIMS simulations).  best_child2() takes any child within STOP_TIE_FRAC of
+// the best mean as a tie, so separating the leader from those doesn't matter
+#define STOP_CHECKS 100
+#define STOP_CHECK_SIMS 16
+#define STOP_TIE_FRAC 0.95
+
+struct EarlyStop {
+  double z; // width of the intervals in standard errors
+  int trials; // rollouts averaged into each simulation's reward
+  int stable_checks; // 0 for no stability rule, else checks in a row with the same leader to stop
+  int leader=-1; // item leading at the last check
+  int same=0; // number of checks in a row it has led
+
+  EarlyStop(double z, int trials, int stable_checks) : z(z), trials(trials), stable_checks(stable_checks) {}
+
+  inline void interval(int N, double Q, double* lo, double* hi) const {
+    // a reward is the fraction of trials rollouts that found the right group, so the
+    // variance of the mean is at most that of N*trials bernoulli trials.  the (x+1)/(n+2)
+    // estimate keeps a width when every rollout succeeded or failed
+    double n = (double)N*trials;
+    double p = (Q*trials+1)/(n+2);
+    double half = z*sqrt(p*(1-p)/(n+2));
+    *lo = Q/N-half > 0 ? Q/N-half : 0; // rewards are in [0,1]
+    *hi = Q/N+half < 1 ? Q/N+half : 1;
+  }
+
+  int check(MonteCarloTree* tree) {
+    // returns STOP_SEPARATED if no root child can plausibly beat the leader (the child with
+    // the best mean, as best_child2() picks) by more than the tie band, STOP_STABLE if the
+    // leader hasn't changed for stable_checks checks, otherwise -1.  reads the stats
+    // atomically, so shared trees can be checked while other threads run simulations
+    TreeNodeMem* mem = &tree->treeMem;
+    int size = __atomic_load_n(&mem->child_size(tree->root), __ATOMIC_ACQUIRE);
+    if (size == 0) {
+      return -1;
+    }
+    int first = mem->first_child(tree->root);
+    int best=-1;
+    double best_mean=-1, best_lo=0, best_hi=0, max_hi=-1;
+    bool all_visited=true;
+    for (int i=first; i<first+size; i++) {
+      int N = __atomic_load_n(&mem->N(i), __ATOMIC_RELAXED);
+      double Q;
+      __atomic_load(&mem->Q(i), &Q, __ATOMIC_RELAXED);
+      if (N <= 0) {
+        all_visited=false;
+        continue;
+      }
+      double lo, hi;
+      interval(N, Q, &lo, &hi);
+      if (Q/N > best_mean) {
+        // the old leader's upper end now counts against the new one
+        max_hi = best >= 0 && best_hi > max_hi ? best_hi : max_hi;
+        best = i;
+        best_mean = Q/N;
+        best_lo = lo;
+        best_hi = hi;
+      } else {
+        max_hi = hi > max_hi ? hi : max_hi;
+      }
+    }
+    if (best < 0) {
+      return -1;
+    }
+    int item = mem->item(best);
+    same = item == leader ? same+1 : 0;
+    leader = item;
+    if (all_visited && max_hi*STOP_TIE_FRAC <= best_lo) {
+      return STOP_SEPARATED;
+    }
+    return stable_checks > 0 && same >= stable_checks ? STOP_STABLE : -1;
+  }
+};
+
+inline int simulation_budget(const SearchConfig& cfg, int num_items, int num_used_items) {
+  // hacky kind of heuristic for number of runs of mcts to use: it scales with the number of
+  // items that can go in the tree and the square of the number of questions still to ask.
+  // run out mem on my laptp if make prefactor larger than about 7.
+  int sim_k = 1;
+  int branching = (cfg.num_candidates > 0 && cfg.num_candidates < num_items) ? cfg.num_candidates : num_items;
+  if (!cfg.use_montecarlo) {
+    return branching;
+  }
+  return int(sim_k*branching*(1.25+(cfg.max_count-num_used_items)*(cfg.max_count-num_used_items)));
+}
+
+// how many simulations run between reads of the clock when there is a time limit or deadline
+#define CLOCK_CHECK_SIMS 16
+
+class Search {
+public:
+  SearchConfig cfg;
+  std::vector<MonteCarloTree> trees;
+  std::vector<Rng> thread_rngs; // one per thread in tree parallel mode
+  std::vector<UnusedItems> thread_unused; // rollout item pools to go with thread_rngs
+
+  Search(const SearchConfig& cfg) : cfg(cfg), trees(cfg.root_threads>1 ? cfg.root_threads : 1),
+    thread_rngs(cfg.tree_threads>1 ? cfg.tree_threads : 0), thread_unused(thread_rngs.size()) {
+    for (auto &t : trees) {
+      t.leaf_threads = cfg.leaf_threads;
+      t.widen_alpha = cfg.widen_alpha;
+      t.treeMem.max_bytes = cfg.max_tree_bytes;
+    }
+  }
+
+  void seed(uint64_t seed, uint64_t stream) {
+    // also starts a new session, so nothing is kept from the last question.  tree 0 keeps
+    // the stream as given, the other root parallel trees and the tree parallel threads get
+    // streams of their own
+    for (size_t t=0; t<trees.size(); t++) {
+      trees[t].seed(seed, stream+((uint64_t)t<<32));
+    }
+    for (size_t t=0; t<thread_rngs.size(); t++) {
+      thread_rngs[t].seed(seed, stream+((uint64_t)(t+1)<<48));
+    }
+    retained=-1;
+    unused_stale=true;
+  }
+
+  void advance(int item) {
+    // call after asking about item, keeps its subtree for the next question if reuse is on
+    for (auto &t : trees) {
+      t.unused.remove(item);
+    }
+    for (auto &u : thread_unused) {
+      u.remove(item);
+    }
+    if (cfg.reuse_discount > 0 && trees.size() == 1) {
+      retained = trees[0].reroot(item, cfg.reuse_discount);
+    } else {
+      retained=-1;
+    }
+  }
+
+  size_t bytes() const {
+    // node memory held by the trees now
+    size_t b=0;
+    for (auto &t : trees) {
+      b += t.bytes();
+    }
+    return b;
+  }
+
+  size_t peak_bytes() const {
+    // the most node memory held, summed over the trees
+    size_t b=0;
+    for (auto &t : trees) {
+      b += t.peak_bytes;
+    }
+    return b;
+  }
+
+  MonteCarloTree& tree() {
+    // after next_item() the root of this tree holds the (merged) root statistics
+    return trees[0];
+  }
+
+  SearchResult next_item(Groups *groups, const Posterior* post, int* used_items, int num_used_items, int simulation_counts) {
+    SearchResult res;
+    auto start = std::chrono::steady_clock::now(); // deadline and time_limit count from here
+    sync_unused(groups, used_items, num_used_items);
+    if (cfg.num_candidates > 0 || cfg.widen_alpha > 0) {
+      select_candidates(groups, post, used_items);
+    }
+    int num_trees = (int)trees.size();
+    bool keep = retained >= 0;
+    if (keep) {
+      // the kept visits count towards the budget
+      simulation_counts = simulation_counts-retained > 1 ? simulation_counts-retained : 1;
+      retained=-1;
+    }
+    res.budget = simulation_counts;
+    res.stop_reason = STOP_BUDGET;
+    if (thread_rngs.size() > 1) {
+      res.num_sims = run_shared_tree(&trees[0], groups, post, used_items, num_used_items, simulation_counts, keep, start, &res.stop_reason);
+    } else if (num_trees == 1) {
+      res.num_sims = run_tree(&trees[0], groups, post, used_items, num_used_items, simulation_counts, keep, start, &res.stop_reason);
+    } else {
+      // split the simulation budget between the trees
+      int tree_counts = (simulation_counts+num_trees-1)/num_trees;
+      int sims[num_trees], reasons[num_trees];
+      #pragma omp parallel for num_threads(num_trees)
+      for (int t=0; t<num_trees; t++) {
+        sims[t] = run_tree(&trees[t], groups, post, used_items, num_used_items, tree_counts, false, start, &reasons[t]);
+      }
+      res.stop_reason = reasons[0];
+      res.num_sims = sims[0];
+      for (int t=1; t<num_trees; t++) {
+        merge_root(&trees[0], &trees[t], groups->num_items);
+        res.num_sims += sims[t];
+        if (reasons[t] == STOP_DEADLINE) {
+          res.stop_reason = STOP_DEADLINE; // the trees share the clock, any of them running out counts
+        }
+      }
+    }
+    for (auto &t : trees) {
+      t.note_bytes();
+    }
+    res.item = best_child2(&trees[0].treeMem, trees[0].root, &trees[0].rng);
+    res.time_ms = elapsed_ms(start);
+    res.deadline_hit = res.stop_reason == STOP_DEADLINE;
+    return res;
+  }
+
+  std::vector<int> candidates; // items allowed in the tree, most discriminating first
+  std::vector<double> scores; // per item discriminability, see Groups::item_scores()
+
+private:
+  int retained=-1; // root visits kept by advance(), -1 if the next search starts afresh
+  bool unused_stale=true; // the rollout pools need building from used_items
+
+  void sync_unused(Groups *groups, int* used_items, int num_used_items) {
+    // the pools are built once per session and then kept up to date by advance(), so this
+    // is O(num_items) only on the first question (or if items were used behind our back)
+    int n = groups->num_items-num_used_items;
+    for (auto &t : trees) {
+      if (unused_stale || t.unused.n != n) {
+        t.unused.build(groups->num_items, used_items);
+      }
+    }
+    for (auto &u : thread_unused) {
+      if (unused_stale || u.n != n) {
+        u.build(groups->num_items, used_items);
+      }
+    }
+    unused_stale=false;
+  }
+
+  void select_candidates(Groups *groups, const Posterior* post, int* used_items) {
+    // rank the unused items by how well they separate the groups under the current posterior,
+    // keeping the best num_candidates of them if set.  progressive widening adds children in
+    // this order.  the scores depend on the group probs so they are redone once per question,
+    // which is O(num_items*num_groups) against the many simulations that follow
+    scores.resize(groups->num_items);
+    groups->item_scores(post->probs.data(), scores.data());
+    candidates.clear();
+    for (int i=0; i<groups->num_items; i++) {
+      if (!used_items[i]) {
+        candidates.push_back(i);
+      }
+    }
+    auto better = [this](int a, int b) {
+      return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+    };
+    if (cfg.num_candidates > 0 && (int)candidates.size() > cfg.num_candidates) {
+      std::nth_element(candidates.begin(), candidates.begin()+cfg.num_candidates, candidates.end(), better);
+      candidates.resize(cfg.num_candidates);
+    }
+    std::sort(candidates.begin(), candidates.end(), better);
+    for (auto &t : trees) {
+      t.candidates = candidates.data();
+      t.num_candidates = (int)candidates.size();
+    }
+  }
+
+  inline double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  inline int min_sims(int simulation_counts) {
+    // with early stopping, this many simulations always run before the first check
+    return (int)(cfg.stop_min_frac*simulation_counts);
+  }
+
+  inline int check_every(int simulation_counts) {
+    return simulation_counts/STOP_CHECKS > STOP_CHECK_SIMS ? simulation_counts/STOP_CHECKS : STOP_CHECK_SIMS;
+  }
+
+  int run_tree(MonteCarloTree* tree, Groups *groups, const Posterior* post, int* used_items, int num_used_items, int simulation_counts, bool keep, std::chrono::steady_clock::time_point start, int* stop_reason) {
+    // runs simulations until the count is reached (and time_limit has passed), the deadline
+    // hits or, with stop_z set, the root children say the answer is clear.  the clock is
+    // only read every CLOCK_CHECK_SIMS simulations
+    if (!keep) {
+      tree->reset(groups->num_items);
+    }
+    bool timed = cfg.deadline > 0 || cfg.time_limit > 0;
+    int count_sim = 0;
+    double diff_time=0.0;
+    int early_min = min_sims(simulation_counts), early_every = check_every(simulation_counts);
+    EarlyStop early(cfg.stop_z, cfg.num_rollouts*groups->num_groups, cfg.stop_stable);
+    *stop_reason = STOP_BUDGET;
+    while (true) {
+      if (timed && count_sim%CLOCK_CHECK_SIMS == 0) {
+        diff_time = elapsed_ms(start);
+      }
+      if (count_sim >= simulation_counts && diff_time >= cfg.time_limit) {
+        break;
+      }
+      if (cfg.deadline > 0 && diff_time >= cfg.deadline) {
+        // only counts as a deadline stop if the simulation count wasn't reached
+        *stop_reason = STOP_DEADLINE;
+        break;
+      }
+      if (cfg.stop_z > 0 && count_sim >= early_min && count_sim%early_every == 0) {
+        int reason = early.check(tree);
+        if (reason >= 0) {
+          *stop_reason = reason;
+          break;
+        }
+      }
+      tree->run(groups, post, used_items, num_used_items, cfg.max_count, cfg.num_rollouts, cfg.max_lookahead, cfg.max_num_rollouts, cfg.use_montecarlo);
+      count_sim++;
+    }
+    return count_sim;
+  }
+
+  int run_shared_tree(MonteCarloTree* tree, Groups *groups, const Posterior* post, int* used_items, int num_used_items, int simulation_counts, bool keep, std::chrono::steady_clock::time_point start, int* stop_reason) {
+    if (!keep) {
+      tree->reset(groups->num_items);
+    }
+    tree->shared = true;
+    tree->virtual_loss = cfg.virtual_loss;
+    bool timed = cfg.deadline > 0 || cfg.time_limit > 0;
+    int count_sim = 0; // simulations started, shared out between the threads
+    int stop = 0; // set by the first thread to see the deadline, or by thread 0 stopping early
+    int num_sims = 0;
+    int early_min = min_sims(simulation_counts), early_every = check_every(simulation_counts);
+    EarlyStop early(cfg.stop_z, cfg.num_rollouts*groups->num_groups, cfg.stop_stable); // only used by thread 0
+    *stop_reason = STOP_BUDGET;
+    #pragma omp parallel num_threads((int)thread_rngs.size()) reduction(+:num_sims)
+    {
+#ifdef _OPENMP
+      int thread = omp_get_thread_num();
+#else
+      int thread = 0;
+#endif
+      Rng* rng = &thread_rngs[thread];
+      UnusedItems* pool = &thread_unused[thread];
+      double diff_time=0.0;
+      while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if (timed && num_sims%CLOCK_CHECK_SIMS == 0) {
+          diff_time = elapsed_ms(start);
+        }
+        if (cfg.deadline > 0 && diff_time >= cfg.deadline && __atomic_load_n(&count_sim, __ATOMIC_RELAXED) < simulation_counts) {
+          __atomic_store_n(stop_reason, STOP_DEADLINE, __ATOMIC_RELAXED);
+          __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+          break;
+        }
+        int started = __atomic_fetch_add(&count_sim, 1, __ATOMIC_RELAXED);
+        if (started >= simulation_counts && diff_time >= cfg.time_limit) {
+          break;
+        }
+        if (thread == 0 && cfg.stop_z > 0 && started >= early_min && num_sims%early_every == 0) {
+          int reason = early.check(tree);
+          if (reason >= 0) {
+            __atomic_store_n(stop_reason, reason, __ATOMIC_RELAXED);
+            __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+            break;
+          }
+        }
+        tree->run_with(rng, pool, groups, post, used_items, num_used_items, cfg.max_count, cfg.num_rollouts, cfg.max_lookahead, cfg.max_num_rollouts, cfg.use_montecarlo);
+        num_sims++;
+      }
+    }
+    tree->shared = false;
+    return num_sims;
+  }
+
+  void merge_root(MonteCarloTree* dst, MonteCarloTree* src, int num_items) {
+    // add the root child stats of src into dst, matching children by item
+    TreeNodeMem* dmem = &dst->treeMem;
+    TreeNodeMem* smem = &src->treeMem;
+    dmem->N(dst->root) += smem->N(src->root);
+    dmem->Q(dst->root) += smem->Q(src->root);
+    int dsize = dmem->child_size(dst->root), ssize = smem->child_size(src->root);
+    if (dsize == 0 || ssize == 0) {
+      return;
+    }
+    int* dN = &dmem->N(dmem->first_child(dst->root));
+    double* dQ = &dmem->Q(dmem->first_child(dst->root));
+    int* ditem = &dmem->item(dmem->first_child(dst->root));
+    int* sN = &smem->N(smem->first_child(src->root));
+    double* sQ = &smem->Q(smem->first_child(src->root));
+    int* sitem = &smem->item(smem->first_child(src->root));
+    bool same_order = (dsize == ssize);
+    for (int i=0; same_order && i<dsize; i++) {
+      same_order = (ditem[i] == sitem[i]);
+    }
+    if (same_order) {
+      // the usual case, expand() lists the unused items in the same order in every tree
+      for (int i=0; i<dsize; i++) {
+        dN[i] += sN[i];
+        dQ[i] += sQ[i];
+      }
+    } else {
+      std::vector<int> posn(num_items, -1);
+      for (int i=0; i<dsize; i++) {
+        posn[ditem[i]] = i;
+      }
+      for (int i=0; i<ssize; i++) {
+        if (posn[sitem[i]] >= 0) {
+          dN[posn[sitem[i]]] += sN[i];
+          dQ[posn[sitem[i]]] += sQ[i];
+        }
+      }
+    }
+  }
+};
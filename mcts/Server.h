@@ -0,0 +1,527 @@
+#pragma once
+
+// Serving mode: newline delimited JSON requests come in on one stream and one JSON response
+// line per request goes out on another, so a front end can run real users' cold-start
+// interviews against a model that is loaded once.  Each session is a ColdStartSession,
+// holding the user's posterior and the items rated so far.  Requests are flat objects, e.g.
+//   {"op":"start_session"}                                  -> {"ok":true,"session":1}
+//   {"op":"next_item","session":1}                          -> {"ok":true,"item":42,"sims":9922,"budget":9922,"time_ms":35.1,"stop":"budget"}
+//   {"op":"submit_rating","session":1,"item":42,"rating":4} -> {"ok":true,"num_ratings":1}
+//   {"op":"estimated_group","session":1}                    -> {"ok":true,"group":3,"probs":[...]}
+//   {"op":"end_session","session":1}                        -> {"ok":true}
+// an "id" field in a request is echoed in its response, errors give {"ok":false,"error":"..."}.
+// Without workers requests are handled one at a time, in order, and each session keeps its
+// own search, whose tree is kept between questions when subtree reuse is on.  With
+// num_workers>0 the reading thread only queues requests and a fixed pool of worker threads
+// runs them, so questions for different sessions are searched at the same time.  A
+// session's requests still run in order, but responses for different sessions can come
+// out of order, so clients should match them up by session or "id".  Each worker has one
+// search (tree node memory and rollout buffers) that it lends to the session it is
+// serving, so memory is bounded by the number of workers (and -M) rather than the number
+// of open users.  Past max_sessions open sessions start_session is refused.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <ctype.h>
+#include <string>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Groups.h"
+#include "Search.h"
+#include "ColdStartSession.h"
+
+struct JsonValue {
+  bool is_string;
+  std::string text; // unescaped contents for strings, the literal otherwise
+};
+
+typedef std::map<std::string, JsonValue> JsonObject;
+
+inline void json_skip_ws(const std::string& s, size_t* p) {
+  while (*p < s.size() && (s[*p] == ' ' || s[*p] == '\t' || s[*p] == '\r' || s[*p] == '\n')) {
+    (*p)++;
+  }
+}
+
+inline bool json_parse_string(const std::string& s, size_t* p, std::string* out) {
+  // *p is at the opening quote.  \u escapes are only kept for ascii, that's all we need
+  if (*p >= s.size() || s[*p] != '"') {
+    return false;
+  }
+  out->clear();
+  for ((*p)++; *p < s.size(); (*p)++) {
+    char c = s[*p];
+    if (c == '"') {
+      (*p)++;
+      return true;
+    }
+    if (c != '\\') {
+      out->push_back(c);
+      continue;
+    }
+    if (++(*p) >= s.size()) {
+      return false;
+    }
+    switch (s[*p]) {
+      case 'n': out->push_back('\n'); break;
+      case 't': out->push_back('\t'); break;
+      case 'r': out->push_back('\r'); break;
+      case 'b': out->push_back('\b'); break;
+      case 'f': out->push_back('\f'); break;
+      case 'u': {
+        if (*p+4 >= s.size()) {
+          return false;
+        }
+        long code = strtol(s.substr(*p+1, 4).c_str(), nullptr, 16);
+        out->push_back(code < 128 ? (char)code : '?');
+        *p += 4;
+        break;
+      }
+      default: out->push_back(s[*p]); break; // \" \\ \/
+    }
+  }
+  return false;
+}
+
+inline bool json_valid_literal(const std::string& t) {
+  // a json number, true, false or null
+  if (t == "true" || t == "false" || t == "null") {
+    return true;
+  }
+  size_t p = 0, n = t.size();
+  if (p < n && t[p] == '-') {
+    p++;
+  }
+  if (p < n && t[p] == '0') {
+    p++;
+  } else if (p < n && t[p] >= '1' && t[p] <= '9') {
+    while (p < n && isdigit((unsigned char)t[p])) {
+      p++;
+    }
+  } else {
+    return false;
+  }
+  if (p < n && t[p] == '.') {
+    if (++p >= n || !isdigit((unsigned char)t[p])) {
+      return false;
+    }
+    while (p < n && isdigit((unsigned char)t[p])) {
+      p++;
+    }
+  }
+  if (p < n && (t[p] == 'e' || t[p] == 'E')) {
+    p++;
+    if (p < n && (t[p] == '+' || t[p] == '-')) {
+      p++;
+    }
+    if (p >= n || !isdigit((unsigned char)t[p])) {
+      return false;
+    }
+    while (p < n && isdigit((unsigned char)t[p])) {
+      p++;
+    }
+  }
+  return p == n;
+}
+
+inline bool json_parse_object(const std::string& s, JsonObject* obj) {
+  // a single flat object: string keys, values that are strings, numbers, true, false or null
+  obj->clear();
+  size_t p = 0;
+  json_skip_ws(s, &p);
+  if (p >= s.size() || s[p] != '{') {
+    return false;
+  }
+  p++;
+  json_skip_ws(s, &p);
+  if (p < s.size() && s[p] == '}') {
+    p++;
+    json_skip_ws(s, &p);
+    return p == s.size();
+  }
+  while (true) {
+    std::string key;
+    json_skip_ws(s, &p);
+    if (!json_parse_string(s, &p, &key)) {
+      return false;
+    }
+    json_skip_ws(s, &p);
+    if (p >= s.size() || s[p] != ':') {
+      return false;
+    }
+    p++;
+    json_skip_ws(s, &p);
+    JsonValue val;
+    if (p < s.size() && s[p] == '"') {
+      val.is_string = true;
+      if (!json_parse_string(s, &p, &val.text)) {
+        return false;
+      }
+    } else {
+      val.is_string = false;
+      size_t start = p;
+      while (p < s.size() && s[p] != ',' && s[p] != '}' && s[p] != ' ' && s[p] != '\t' && s[p] != '\r') {
+        if (s[p] == '{' || s[p] == '[') {
+          return false; // nested values aren't part of the protocol
+        }
+        p++;
+      }
+      val.text = s.substr(start, p-start);
+      if (!json_valid_literal(val.text)) {
+        return false;
+      }
+    }
+    (*obj)[key] = val;
+    json_skip_ws(s, &p);
+    if (p < s.size() && s[p] == ',') {
+      p++;
+      continue;
+    }
+    if (p < s.size() && s[p] == '}') {
+      p++;
+      json_skip_ws(s, &p);
+      return p == s.size();
+    }
+    return false;
+  }
+}
+
+inline std::string json_quote(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out.push_back(c);
+    }
+  }
+  return out+"\"";
+}
+
+inline bool json_get_number(const JsonObject& obj, const char* key, double* val) {
+  auto it = obj.find(key);
+  if (it == obj.end() || it->second.is_string) {
+    return false;
+  }
+  char* end;
+  *val = strtod(it->second.text.c_str(), &end);
+  return *end == 0 && isfinite(*val);
+}
+
+inline bool json_get_int(const JsonObject& obj, const char* key, long* val) {
+  double d;
+  if (!json_get_number(obj, key, &d) || d != floor(d) || fabs(d) > 1e15) {
+    return false;
+  }
+  *val = (long)d;
+  return true;
+}
+
+// most requests that can wait for one session while a worker has it, more are refused
+#define SERVER_MAX_PENDING 16
+
+// a session as the server holds it.  with worker threads a session's requests queue up in
+// pending and only one worker at a time takes them, so they still run in order
+struct ServerSession {
+  ColdStartSession session;
+  std::deque<std::pair<std::string, JsonObject>> pending; // (op, request)
+  bool scheduled = false; // in the run queue or with a worker
+  bool closing = false; // its end_session is queued, so it no longer counts as open
+
+  ServerSession(Groups* groups, const SearchConfig& cfg) : session(groups, cfg) {}
+};
+
+class Server {
+public:
+  Groups* groups; // shared read-only by all sessions and workers
+  SearchConfig cfg;
+  uint64_t seed;
+  int num_workers; // 0 handles requests one at a time on the reading thread
+  int max_sessions; // open sessions allowed, 0 for no limit
+  std::unordered_map<long, std::unique_ptr<ServerSession>> sessions;
+  long next_session = 1;
+
+  Server(Groups* groups, const SearchConfig& cfg, uint64_t seed, int num_workers=0, int max_sessions=0) :
+    groups(groups), cfg(cfg), seed(seed), num_workers(num_workers), max_sessions(max_sessions) {}
+
+  int serve(FILE* in, FILE* out) {
+    // handle requests until in is closed.  with workers the searches for different sessions
+    // run at the same time, and responses go out as they finish (in order per session)
+    std::vector<std::thread> workers;
+    for (int w=0; w<num_workers; w++) {
+      workers.emplace_back(&Server::work, this, out);
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::string line;
+    int c;
+    while (true) {
+      line.clear();
+      while ((c = fgetc(in)) != EOF && c != '\n') {
+        line.push_back((char)c);
+      }
+      if (line.find_first_not_of(" \t\r") != std::string::npos) {
+        std::string resp = num_workers > 0 ? dispatch(line) : handle(line);
+        if (!resp.empty()) {
+          respond(out, resp);
+        }
+      }
+      if (c == EOF) {
+        break;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (auto &w : workers) {
+      w.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("served %ld sessions, %ld questions in %gs (%g questions/s) with %d workers, %ld requests refused, tree memory peak %.2f MB per search\n",
+           next_session-1, num_questions, secs, secs > 0 ? num_questions/secs : 0.0, num_workers, num_refused, peak_bytes/1048576.0);
+    return 0;
+  }
+
+  std::string handle(const std::string& line) {
+    // one request line in, one response line out
+    JsonObject req;
+    std::string name, resp;
+    long id;
+    if (!parse_request(line, &req, &name, &id, &resp)) {
+      return resp;
+    }
+    if (name == "start_session") {
+      return start_session(req);
+    }
+    auto it = sessions.find(id);
+    if (it == sessions.end()) {
+      return error(req, "no session "+std::to_string(id));
+    }
+    resp = run(req, name, &it->second->session, nullptr);
+    if (name == "end_session") {
+      sessions.erase(it);
+    }
+    return resp;
+  }
+
+private:
+  // with workers, lock guards sessions, run_queue and the counters, and out_lock the output
+  std::mutex lock, out_lock;
+  std::condition_variable ready;
+  std::deque<long> run_queue; // sessions with pending requests, waiting for a worker
+  bool stopping = false;
+  long num_questions = 0, num_refused = 0;
+  int num_closing = 0; // sessions with an end_session queued
+  size_t peak_bytes = 0; // most tree memory held by one search
+
+  void respond(FILE* out, const std::string& resp) {
+    std::lock_guard<std::mutex> guard(out_lock);
+    fprintf(out, "%s\n", resp.c_str());
+    fflush(out);
+  }
+
+  bool parse_request(const std::string& line, JsonObject* req, std::string* name, long* id, std::string* resp) {
+    // checks the op, and the session for all but start_session.  false with *resp set if bad
+    if (!json_parse_object(line, req)) {
+      *resp = error(*req, "request is not a flat json object");
+      return false;
+    }
+    auto op = req->find("op");
+    if (op == req->end() || !op->second.is_string) {
+      *resp = error(*req, "missing op");
+      return false;
+    }
+    *name = op->second.text;
+    if (*name == "start_session") {
+      return true;
+    }
+    if (*name != "next_item" && *name != "submit_rating" && *name != "estimated_group" && *name != "end_session") {
+      *resp = error(*req, "unknown op "+*name);
+      return false;
+    }
+    if (!json_get_int(*req, "session", id)) {
+      *resp = error(*req, "missing session");
+      return false;
+    }
+    return true;
+  }
+
+  std::string dispatch(const std::string& line) {
+    // queues a request for the workers, returns a response now only if it isn't queued
+    JsonObject req;
+    std::string name, resp;
+    long id;
+    if (!parse_request(line, &req, &name, &id, &resp)) {
+      return resp;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (name == "start_session") {
+      return start_session(req);
+    }
+    auto it = sessions.find(id);
+    if (it == sessions.end()) {
+      return error(req, "no session "+std::to_string(id));
+    }
+    ServerSession* s = it->second.get();
+    if (s->pending.size() >= SERVER_MAX_PENDING) {
+      num_refused++;
+      return error(req, "too many requests waiting for session "+std::to_string(id));
+    }
+    s->pending.emplace_back(name, req);
+    if (name == "end_session" && !s->closing) {
+      s->closing = true;
+      num_closing++;
+    }
+    if (!s->scheduled) {
+      s->scheduled = true;
+      run_queue.push_back(id);
+      ready.notify_one();
+    }
+    return "";
+  }
+
+  void work(FILE* out) {
+    // a worker thread: takes one request at a time from the session at the head of the run
+    // queue, and lends the session this worker's search, so the tree memory is one arena
+    // per worker however many sessions are open
+    Search search(cfg);
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+      ready.wait(guard, [this] { return !run_queue.empty() || stopping; });
+      if (run_queue.empty()) {
+        break;
+      }
+      long id = run_queue.front();
+      run_queue.pop_front();
+      ServerSession* s = sessions[id].get();
+      std::pair<std::string, JsonObject> op = std::move(s->pending.front());
+      s->pending.pop_front();
+      guard.unlock();
+      // the response goes out before the session can be rescheduled, to keep them in order
+      respond(out, run(op.second, op.first, &s->session, &search));
+      guard.lock();
+      if (op.first == "end_session") {
+        for (auto &p : s->pending) {
+          respond(out, error(p.second, "no session "+std::to_string(id)));
+        }
+        num_closing--;
+        sessions.erase(id);
+      } else if (!s->pending.empty()) {
+        // back of the queue, so a busy session doesn't hold up the others
+        run_queue.push_back(id);
+        ready.notify_one();
+      } else {
+        s->scheduled = false;
+      }
+    }
+  }
+
+  std::string ok(const JsonObject& req, const std::string& fields) {
+    return "{"+echo_id(req)+"\"ok\":true"+fields+"}";
+  }
+
+  std::string error(const JsonObject& req, const std::string& msg) {
+    return "{"+echo_id(req)+"\"ok\":false,\"error\":"+json_quote(msg)+"}";
+  }
+
+  std::string echo_id(const JsonObject& req) {
+    auto it = req.find("id");
+    if (it == req.end() || (!it->second.is_string && !json_valid_literal(it->second.text))) {
+      return ""; // the parser refuses bad literals, but never echo one back
+    }
+    return "\"id\":"+(it->second.is_string ? json_quote(it->second.text) : it->second.text)+",";
+  }
+
+  std::string start_session(const JsonObject& req) {
+    // admission control: past max_sessions new users are turned away until others end,
+    // which bounds the memory held for sessions.  a session whose end_session is still
+    // queued has already been let go by its user, so it doesn't count
+    int num_open = (int)sessions.size()-num_closing;
+    if (max_sessions > 0 && num_open >= max_sessions) {
+      num_refused++;
+      return error(req, "server is full, "+std::to_string(num_open)+" sessions open");
+    }
+    long id = next_session++;
+    std::unique_ptr<ServerSession> s(new ServerSession(groups, cfg));
+    // each session has its own random streams, as each (group, try) does in batch mode
+    s->session.start(seed, 2*(uint64_t)id);
+    sessions[id] = std::move(s);
+    return ok(req, ",\"session\":"+std::to_string(id));
+  }
+
+  std::string run(const JsonObject& req, const std::string& name, ColdStartSession* s, Search* search) {
+    // one request for session s, searching with the worker's search if given, else the
+    // session's own (which keeps subtrees between questions).  end_session is left to the caller
+    if (name == "next_item") {
+      return next_item(req, s, search);
+    } else if (name == "submit_rating") {
+      return submit_rating(req, s);
+    } else if (name == "estimated_group") {
+      return estimated_group(req, s);
+    }
+    return ok(req, "");
+  }
+
+  std::string next_item(const JsonObject& req, ColdStartSession* s, Search* pooled) {
+    if (s->num_ratings() >= cfg.max_count) {
+      return error(req, "session already has "+std::to_string(cfg.max_count)+" ratings");
+    }
+    if (s->done()) {
+      return error(req, "no items left to ask about");
+    }
+    SearchResult res = pooled ? s->next_item(pooled) : s->next_item();
+    size_t bytes = pooled ? pooled->peak_bytes() : s->search.peak_bytes();
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      num_questions++;
+      peak_bytes = std::max(peak_bytes, bytes);
+    }
+    char buf[256];
+    snprintf(buf, sizeof(buf), ",\"item\":%d,\"sims\":%d,\"budget\":%d,\"time_ms\":%.3f,\"stop\":\"%s\"",
+             res.item, res.num_sims, res.budget, res.time_ms, stop_names[res.stop_reason]);
+    return ok(req, buf);
+  }
+
+  std::string submit_rating(const JsonObject& req, ColdStartSession* s) {
+    long item;
+    double rating;
+    if (!json_get_int(req, "item", &item) || item < 0 || item >= groups->num_items) {
+      return error(req, "missing or out of range item");
+    }
+    if (!json_get_number(req, "rating", &rating)) {
+      return error(req, "missing rating");
+    }
+    if (s->used_items[item]) {
+      return error(req, "item "+std::to_string(item)+" is already rated");
+    }
+    if (!s->submit_rating((int)item, rating)) {
+      return error(req, "session already has "+std::to_string(s->num_ratings())+" ratings");
+    }
+    return ok(req, ",\"num_ratings\":"+std::to_string(s->num_ratings()));
+  }
+
+  std::string estimated_group(const JsonObject& req, ColdStartSession* s) {
+    std::string fields = ",\"group\":"+std::to_string(s->estimated_group())+",\"probs\":[";
+    char buf[32];
+    for (int g=0; g<groups->num_groups; g++) {
+      snprintf(buf, sizeof(buf), "%s%.6g", g > 0 ? "," : "", s->probs()[g]);
+      fields += buf;
+    }
+    return ok(req, fields+"]");
+  }
+};
@@ -1,154 +1,424 @@
 #pragma once
 
 #include <vector>
+#include <mutex>
+#include <thread>
 #include <chrono>
 #include "utils.h"
 
-#include <random>
-std::random_device rd{};
-std::mt19937 gen{rd()}; // mersenne twister, faster?
-std::uniform_real_distribution<double> uniform(0.0,1.0);
-
-// we trade off memory usage for greater speed by preallocating child array.
-// this also limits the max number of items that can be conisdered
-#define MAX_BRANCHING 1500
-
-struct TreeNode {
-  TreeNode* child[MAX_BRANCHING];
-  int child_size;
-  int item;
-  int N;
-  double Q;
-  //double Q2;
-  void* mem;
+#include "Rng.h"
+#include "UsedSet.h"
+
+// nodes are allocated in blocks of 1<<block_bits, at least 1<<TREE_BLOCK_BITS.  a block
+// must be able to hold all the children of a node, so reserve() grows the blocks to fit
+// the number of items
+#define TREE_BLOCK_BITS 12
+
+// tree nodes are stored as a structure of arrays, a node is identified by its index.
+// the children of a node always occupy one contiguous range of indices
+// [first_child, first_child+child_size) within a block, so the N and Q values of
+// siblings sit next to each other in memory and can be scanned without chasing pointers.
+struct TreeNodeBlock {
+  double* Q;
+  int* N;
+  int* item;
+  int* first_child;
+  int* child_size;
+  int* state; // expansion state, used when several threads share a tree
+  int* child_cap; // size of the range holding the children, can be more than child_size with widening
+  int* widen; // progressive widening: where widen() carries on in the candidate list
 };
 
-// do our own memory management
+// node expansion states, a node is expanded at most once
+enum { NODE_LEAF=0, NODE_EXPANDING=1, NODE_EXPANDED=2 };
+
+// max number of blocks per tree.  the block directory has a fixed size so that it never
+// moves, which lets threads sharing a tree read nodes while another thread allocates.
+// node indices are ints, so with big blocks there are fewer of them
+#define MAX_TREE_BLOCKS (1<<14)
+
+// bytes per node, summed over the arrays of a block
+#define TREE_NODE_BYTES (sizeof(double)+7*sizeof(int))
+
+// do our own memory management.  ranges handed back by free_TreeNodes() go on a free list
+// per range size and are reused first.  with max_bytes set no new block is allocated past
+// that size (the first block always is), alloc_TreeNodes() returns -1 and sets full instead
 struct TreeNodeMem {
-  std::vector<TreeNode*> availTreeNodes={};
-  int list_posn=0, node_posn=0;
+  TreeNodeBlock* blocks=nullptr;
+  int block_bits=TREE_BLOCK_BITS, block_mask=(1<<TREE_BLOCK_BITS)-1;
+  int num_blocks=0;
+  int block_posn=0, node_posn=0;
   int numTreeNodesallocated=0;
   int numTreeNodesreused=0;
+  int nodes_in_use=0;
+  size_t max_bytes=0; // 0 for no limit
+  bool full=false; // an allocation failed because of max_bytes
+  std::vector<std::vector<int>> free_ranges; // free_ranges[count] holds the first nodes of free ranges of count nodes
+  std::mutex alloc_lock;
+
+  TreeNodeMem() {}
+  TreeNodeMem(const TreeNodeMem&) = delete;
+  TreeNodeMem& operator=(const TreeNodeMem&) = delete;
+  ~TreeNodeMem() {
+    release();
+    free(blocks);
+  }
+
+  void release() {
+    // give all the blocks back, only call on an empty tree
+    for (int b=0; b<num_blocks; b++) {
+      free(blocks[b].Q);
+    }
+    num_blocks=0; block_posn=0; node_posn=0;
+    nodes_in_use=0;
+    full=false;
+    free_ranges.clear();
+  }
+
+  inline size_t bytes() const {
+    // memory held in blocks, whether the nodes are in use or not
+    return (size_t)num_blocks*((size_t)1<<block_bits)*TREE_NODE_BYTES;
+  }
+
+  void reserve(int max_children) {
+    // makes blocks big enough for max_children siblings.  only call on an empty tree i.e.
+    // after free_allTreeNodes(), bigger blocks mean the existing ones are thrown away
+    int bits = TREE_BLOCK_BITS;
+    while ((1<<bits) < max_children) {
+      bits++;
+    }
+    if (bits <= block_bits) {
+      return;
+    }
+    if (bits > 30) {
+      printf("ERROR: can't make tree blocks for %d children\n",max_children);
+      exit(1);
+    }
+    release();
+    block_bits=bits; block_mask=(1<<bits)-1;
+  }
+
+  inline int max_blocks() const {
+    return (1<<(31-block_bits)) < MAX_TREE_BLOCKS ? (1<<(31-block_bits)) : MAX_TREE_BLOCKS;
+  }
+
+  void swap(TreeNodeMem& other) {
+    // exchange the node storage of two stores (not thread safe)
+    std::swap(blocks, other.blocks);
+    std::swap(block_bits, other.block_bits);
+    std::swap(block_mask, other.block_mask);
+    std::swap(num_blocks, other.num_blocks);
+    std::swap(block_posn, other.block_posn);
+    std::swap(node_posn, other.node_posn);
+    std::swap(numTreeNodesallocated, other.numTreeNodesallocated);
+    std::swap(numTreeNodesreused, other.numTreeNodesreused);
+    std::swap(nodes_in_use, other.nodes_in_use);
+    std::swap(max_bytes, other.max_bytes);
+    std::swap(full, other.full);
+    std::swap(free_ranges, other.free_ranges);
+  }
+
+  inline double& Q(int n) { return blocks[n>>block_bits].Q[n&block_mask]; }
+  inline int& N(int n) { return blocks[n>>block_bits].N[n&block_mask]; }
+  inline int& item(int n) { return blocks[n>>block_bits].item[n&block_mask]; }
+  inline int& first_child(int n) { return blocks[n>>block_bits].first_child[n&block_mask]; }
+  inline int& child_size(int n) { return blocks[n>>block_bits].child_size[n&block_mask]; }
+  inline int& state(int n) { return blocks[n>>block_bits].state[n&block_mask]; }
+  inline int& child_cap(int n) { return blocks[n>>block_bits].child_cap[n&block_mask]; }
+  inline int& widen(int n) { return blocks[n>>block_bits].widen[n&block_mask]; }
 };
-TreeNode* alloc_TreeNode(TreeNodeMem* mem) {
-  if (mem->availTreeNodes.size()==0) {
-    // allocate a block of new tree nodes since expect repeated calls from expand()
-    TreeNode* newnodes = (TreeNode*)malloc(sizeof(TreeNode)*MAX_BRANCHING);
-    mem->availTreeNodes.push_back(newnodes);
-    mem->list_posn=0;
-    mem->node_posn=0;
-    mem->numTreeNodesallocated+=MAX_BRANCHING;
-  } else {
-    mem->numTreeNodesreused++;
+
+inline int alloc_TreeNodes(TreeNodeMem* mem, int count) {
+  // allocate count nodes as one contiguous range, returns index of the first node, or -1
+  // if the memory cap is reached
+  const int block_size = 1<<mem->block_bits;
+  std::lock_guard<std::mutex> guard(mem->alloc_lock);
+  if (count < (int)mem->free_ranges.size() && !mem->free_ranges[count].empty()) {
+    int first = mem->free_ranges[count].back();
+    mem->free_ranges[count].pop_back();
+    mem->nodes_in_use+=count;
+    mem->numTreeNodesreused+=count;
+    return first;
+  }
+  if (mem->node_posn+count > block_size && mem->block_posn+1 == mem->num_blocks
+      && mem->max_bytes > 0 && mem->bytes()+(size_t)block_size*TREE_NODE_BYTES > mem->max_bytes) {
+    // a new block would go over the cap
+    mem->full=true;
+    return -1;
   }
-  TreeNode* newnode = &(mem->availTreeNodes[mem->list_posn][mem->node_posn]);
-  newnode->mem = mem;
-  mem->node_posn++;
-  if (mem->node_posn==MAX_BRANCHING) {
+  if (mem->node_posn+count > block_size) {
+    // range doesn't fit in the rest of this block, move on to the next one
+    mem->block_posn++;
     mem->node_posn=0;
-    mem->list_posn++;
-    if (mem->list_posn == (int)mem->availTreeNodes.size()){
-      TreeNode* newnodes = (TreeNode*)malloc(sizeof(TreeNode)*MAX_BRANCHING);
-      mem->availTreeNodes.push_back(newnodes);
-      mem->numTreeNodesallocated+=MAX_BRANCHING;
+  }
+  if (mem->block_posn == mem->num_blocks) {
+    if (mem->blocks == nullptr) {
+      mem->blocks = (TreeNodeBlock*)calloc(MAX_TREE_BLOCKS, sizeof(TreeNodeBlock));
+    }
+    if (mem->num_blocks == mem->max_blocks()) {
+      printf("ERROR: tree is too large, %d nodes allocated\n",mem->numTreeNodesallocated);
+      exit(1);
+    }
+    // one malloc per block, with the per-node arrays laid out one after the other
+    TreeNodeBlock b;
+    b.Q = (double*)malloc(block_size*TREE_NODE_BYTES);
+    if (b.Q == nullptr) {
+      printf("ERROR: out of memory allocating tree nodes (%d allocated)\n",mem->numTreeNodesallocated);
+      exit(1);
     }
+    b.N = (int*)(b.Q+block_size);
+    b.item = b.N+block_size;
+    b.first_child = b.item+block_size;
+    b.child_size = b.first_child+block_size;
+    b.state = b.child_size+block_size;
+    b.child_cap = b.state+block_size;
+    b.widen = b.child_cap+block_size;
+    mem->blocks[mem->num_blocks] = b;
+    mem->num_blocks++;
+    mem->numTreeNodesallocated+=block_size;
+  } else {
+    mem->numTreeNodesreused+=count;
+  }
+  int first = (mem->block_posn<<mem->block_bits) + mem->node_posn;
+  mem->node_posn+=count;
+  mem->nodes_in_use+=count;
+  return first;
+}
+inline void free_TreeNodes(TreeNodeMem* mem, int first, int count) {
+  // hand back a range from alloc_TreeNodes(), it is reused for the next range of the same size
+  std::lock_guard<std::mutex> guard(mem->alloc_lock);
+  if (count >= (int)mem->free_ranges.size()) {
+    mem->free_ranges.resize(count+1);
   }
-  return newnode;
+  mem->free_ranges[count].push_back(first);
+  mem->nodes_in_use-=count;
 }
-void free_allTreeNodes(TreeNodeMem* mem) {
+inline void free_allTreeNodes(TreeNodeMem* mem) {
   // move all the allocated nodes back onto the free list
-  mem->list_posn=0; mem->node_posn=0;
+  mem->block_posn=0; mem->node_posn=0;
+  mem->nodes_in_use=0;
+  mem->full=false;
+  for (auto &r : mem->free_ranges) {
+    r.clear();
+  }
   DEBUG_PRINT("num tree nodes allocated/reused %d/%d\n",mem->numTreeNodesallocated,mem->numTreeNodesreused);
 }
 
 
-void print_TreeNode(TreeNode* node) {
-  printf("node (item,Q,N) %d:%g/%d, children:",node->item,node->Q,node->N);
-  for (int i=0; i<node->child_size; i++) {
-    printf("%d:%g/%d ",node->child[i]->item,node->child[i]->Q,node->child[i]->N);
+inline void print_TreeNode(TreeNodeMem* mem, int node) {
+  printf("node (item,Q,N) %d:%g/%d, children:",mem->item(node),mem->Q(node),mem->N(node));
+  int first=mem->first_child(node);
+  for (int i=first; i<first+mem->child_size(node); i++) {
+    printf("%d:%g/%d ",mem->item(i),mem->Q(i),mem->N(i));
   }
   printf("\n");
 }
 
-void expand(TreeNode* node, TreeNode** path, int num_path, int num_items,  int* used_items) {
+inline void expand(TreeNodeMem* mem, int node, int* path, int num_path, int num_items,  int* used_items, const int* candidates=nullptr, int num_candidates=0) {
+  // the children are the items not used and not on the path.  if candidates is set only
+  // those items are considered, in the order given, otherwise all num_items items are
   DEBUG_PRINT("expand num_items %d, num_path %d\n",num_items,num_path);
-  if (num_items>MAX_BRANCHING) {
-    printf("ERROR: number of items %d > tree MAX_BRANCHING %d\n!",num_items,MAX_BRANCHING);
-    exit(1); // this is fatal
+  // per thread scratch, marking the path is O(path length) and there is nothing to undo
+  static thread_local UsedSet excluded;
+  static thread_local std::vector<int> unused_list;
+  if ((int)unused_list.size() < num_items) {
+    unused_list.resize(num_items);
   }
-  int path_items[MAX_BRANCHING]={};
-  int unused_list[MAX_BRANCHING]={}, num_list=0;
+  excluded.begin(used_items, num_items);
+  int num_list=0;
   for (int i=1; i<num_path; i++) { // first node of path is root, it has item -1
 #ifdef DEBUG_MEM
-    if (path[i]->item<0 || path[i]->item>MAX_BRANCHING-1) {
-      printf("ERROR: In expand() item %d is out of range",path[i]->item);
+    if (mem->item(path[i])<0 || mem->item(path[i])>num_items-1) {
+      printf("ERROR: In expand() item %d is out of range",mem->item(path[i]));
       exit(1);
     }
 #endif
-    path_items[path[i]->item]=1;
+    excluded.mark(mem->item(path[i]));
   }
-  for (int m=0; m<num_items; m++) {
-    if ((!used_items[m]) && (!path_items[m])) {
+  int num_considered = candidates ? num_candidates : num_items;
+  for (int c=0; c<num_considered; c++) {
+    int m = candidates ? candidates[c] : c;
+    if (!excluded.contains(m)) {
       // item m not shown to user and not in a parent node
       unused_list[num_list]=m;
       num_list++;
     };
   }
   //printf("expand %d %d %d",root->num_items, path->size(), node->item);
-  DEBUG_PRINT("expanded unused items %d: ",num_list); print_items(unused_list, num_list);
+  DEBUG_PRINT("expanded unused items %d: ",num_list); print_items(unused_list.data(), num_list);
   
   if (num_list == 0) {
     return;
   }
   
-  node->child_size = num_list;
-  
-  //#pragma omp parallel for
-  for (int i=0; i<node->child_size; i++) {
-    //#pragma omp critical
-    {
-      node->child[i] = alloc_TreeNode((TreeNodeMem*)node->mem);
-    }
-    node->child[i]->item = unused_list[i];
-    node->child[i]->Q=0;
-    //node->child[i]->Q2=0;
-    node->child[i]->N=0;
-    node->child[i]->child_size=0;
+  // children are allocated as one contiguous range, so initialise them via plain arrays
+  int first = alloc_TreeNodes(mem, num_list);
+  if (first < 0) {
+    return; // out of memory, the node stays a leaf
+  }
+  int* item = &mem->item(first);
+  int* N = &mem->N(first);
+  double* Q = &mem->Q(first);
+  int* child_size = &mem->child_size(first);
+  int* state = &mem->state(first);
+  int* child_cap = &mem->child_cap(first);
+  int* widen = &mem->widen(first);
+  for (int i=0; i<num_list; i++) {
+    item[i] = unused_list[i];
+    Q[i]=0;
+    N[i]=0;
+    child_size[i]=0;
+    state[i]=NODE_LEAF;
+    child_cap[i]=0;
+    widen[i]=0;
+  }
+  mem->first_child(node) = first;
+  mem->child_cap(node) = num_list;
+  mem->widen(node) = num_considered;
+  // publish the children last, threads sharing the tree descend once they see child_size>0
+  __atomic_store_n(&mem->child_size(node), num_list, __ATOMIC_RELEASE);
+}
+
+inline int widen(TreeNodeMem* mem, int node, int* path, int num_path, int num_items, int* used_items, const int* candidates, int num_candidates, int target) {
+  // progressive widening: adds children to node, taking the items of candidates in order,
+  // until it has target of them or the candidates run out, returns the number of children.
+  // node is the last entry of path.  the children sit in a range of child_cap nodes, when
+  // that is full they are copied to a new range twice the size (their subtrees are found
+  // by index so they stay put, and the old range goes on the free list).
+  // not thread safe, so not for shared trees
+  int size = mem->child_size(node);
+  int posn = mem->widen(node);
+  if (size >= target || posn >= num_candidates) {
+    return size;
+  }
+  static thread_local UsedSet excluded;
+  static thread_local std::vector<int> new_items;
+  excluded.begin(used_items, num_items);
+  // skip the path items and the existing children, which after reroot() need not come
+  // from the current candidate list
+  int first = mem->first_child(node);
+  for (int i=1; i<num_path; i++) {
+    excluded.mark(mem->item(path[i]));
+  }
+  for (int i=first; i<first+size; i++) {
+    excluded.mark(mem->item(i));
+  }
+  new_items.clear();
+  for (; posn<num_candidates && size+(int)new_items.size()<target; posn++) {
+    int m = candidates[posn];
+    if (!excluded.contains(m)) {
+      new_items.push_back(m);
+    }
+  }
+  int num_new = (int)new_items.size();
+  if (num_new == 0) {
+    mem->widen(node) = posn;
+    return size;
+  }
+  if (size+num_new > mem->child_cap(node)) {
+    int cap = 2*mem->child_cap(node) > size+num_new ? 2*mem->child_cap(node) : size+num_new;
+    cap = cap < num_candidates ? cap : num_candidates;
+    int new_first = alloc_TreeNodes(mem, cap);
+    if (new_first < 0) {
+      return size; // out of memory, the cursor stays put so these items are tried again later
+    }
+    for (int i=0; i<size; i++) {
+      mem->Q(new_first+i) = mem->Q(first+i);
+      mem->N(new_first+i) = mem->N(first+i);
+      mem->item(new_first+i) = mem->item(first+i);
+      mem->first_child(new_first+i) = mem->first_child(first+i);
+      mem->child_size(new_first+i) = mem->child_size(first+i);
+      mem->state(new_first+i) = mem->state(first+i);
+      mem->child_cap(new_first+i) = mem->child_cap(first+i);
+      mem->widen(new_first+i) = mem->widen(first+i);
+    }
+    if (mem->child_cap(node) > 0) {
+      free_TreeNodes(mem, first, mem->child_cap(node));
+    }
+    first = new_first;
+    mem->first_child(node) = first;
+    mem->child_cap(node) = cap;
+  }
+  mem->widen(node) = posn;
+  for (int i=0; i<num_new; i++) {
+    int c = first+size+i;
+    mem->item(c) = new_items[i];
+    mem->Q(c)=0;
+    mem->N(c)=0;
+    mem->child_size(c)=0;
+    mem->state(c)=NODE_LEAF;
+    mem->child_cap(c)=0;
+    mem->widen(c)=0;
+  }
+  mem->child_size(node) = size+num_new;
+  mem->state(node) = NODE_EXPANDED;
+  return size+num_new;
+}
+
+inline void expand_once(TreeNodeMem* mem, int node, int* path, int num_path, int num_items,  int* used_items, const int* candidates=nullptr, int num_candidates=0) {
+  // thread-safe expand() for a shared tree: the thread that moves the node state from leaf to
+  // expanding does the expansion, any other thread arriving meanwhile waits until it is done
+  int expected = NODE_LEAF;
+  if (__atomic_compare_exchange_n(&mem->state(node), &expected, NODE_EXPANDING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    expand(mem, node, path, num_path, num_items, used_items, candidates, num_candidates);
+    __atomic_store_n(&mem->state(node), NODE_EXPANDED, __ATOMIC_RELEASE);
+  } else {
+    while (__atomic_load_n(&mem->state(node), __ATOMIC_ACQUIRE) == NODE_EXPANDING) {
+      std::this_thread::yield();
+    }
   }
 }
 
-int child_lowestN(TreeNode* node) {
-  if (node->child_size == 0) {
+inline void atomic_add(int* x, int v) {
+  __atomic_fetch_add(x, v, __ATOMIC_RELAXED);
+}
+
+inline void atomic_add(double* x, double v) {
+  double old, sum;
+  __atomic_load(x, &old, __ATOMIC_RELAXED);
+  do {
+    sum = old+v;
+  } while (!__atomic_compare_exchange(x, &old, &sum, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+inline int child_lowestN(TreeNodeMem* mem, int node) {
+  if (mem->child_size(node) == 0) {
     return -1;
   }
-  int lowestN=node->child[0]->N;
-  for (int i = 1 ; i < node->child_size; ++i) {
-    if (node->child[i]->N < lowestN) {
-      lowestN = node->child[i]->N;
+  int* N = &mem->N(mem->first_child(node));
+  int lowestN=N[0];
+  for (int i = 1 ; i < mem->child_size(node); ++i) {
+    if (N[i] < lowestN) {
+      lowestN = N[i];
     }
   }
   return lowestN;
 }
 
-int best_child(TreeNode* node) {
+inline int best_child(TreeNodeMem* mem, int node, Rng* rng) {
   int most_visited = -1;
   double highest_score = -1;
   int highest_item = -1;
-  double logN=2*log(node->N*1.0);
+  double logN=2*log(mem->N(node)*1.0);
   //int best_item = -1;
   
-  if (node->child_size == 0) {
+  int child_size = mem->child_size(node);
+  if (child_size == 0) {
     return -1;
   }
-  for (int i = 0 ; i < node->child_size; ++i) {
-    if (node->child[i]->N > most_visited) {
-      most_visited = node->child[i]->N;
-      //best_item = node->child[i]->item;
+  int first = mem->first_child(node);
+  int* N = &mem->N(first);
+  double* Q = &mem->Q(first);
+  int* item = &mem->item(first);
+  for (int i = 0 ; i < child_size; ++i) {
+    if (N[i] > most_visited) {
+      most_visited = N[i];
+      //best_item = item[i];
     }
-    double score = node->child[i]->Q/node->child[i]->N + sqrt( logN/node->child[i]->N );
+    double score = Q[i]/N[i] + sqrt( logN/N[i] );
     if (score > highest_score) {
       highest_score = score;
-      highest_item = node->child[i]->item;
+      highest_item = item[i];
     }
   }
 // return highest_item;
@@ -156,14 +426,14 @@ int best_child(TreeNode* node) {
 #define MAX_BESTITEMS 100
 // printf("score:%g, item:%d\n", highest_score, highest_item);
   int best_items[MAX_BESTITEMS]; int num_bestitems=0;
-  for (int i = 0 ; i < node->child_size; ++i) {
-    if ((node->child[i]->N == most_visited)) {
-      double score = node->child[i]->Q/node->child[i]->N + sqrt( logN/node->child[i]->N );
+  for (int i = 0 ; i < child_size; ++i) {
+    if ((N[i] == most_visited)) {
+      double score = Q[i]/N[i] + sqrt( logN/N[i] );
       if (score < 0.95*highest_score) {
         // should probably increase number of runs if this happens
         //printf("WARNING: most visited node score %g does not have highest score %g\n",score, highest_score);
       }
-      best_items[num_bestitems]=node->child[i]->item;
+      best_items[num_bestitems]=item[i];
       // printf("score:%g, item:%d\n", score, best_items[num_bestitems]);
       num_bestitems++;
       if (num_bestitems==MAX_BESTITEMS) {
@@ -171,44 +441,58 @@ int best_child(TreeNode* node) {
       }
     }
   }
-  int rnd = (int)(uniform(gen)*(num_bestitems-1)+0.5);
+  int rnd = (int)(rng->uniform()*(num_bestitems-1)+0.5);
   // exit(0);
   return best_items[rnd];
 }
 
 
 
-int best_child2(TreeNode* node) {
+inline int best_child2(TreeNodeMem* mem, int node, Rng* rng) {
   int most_visited = -1;
   double highest_score = -1;
   int highest_item = -1;
-  double logN=2*log(node->N*1.0);
   //int best_item = -1;
   
-  if (node->child_size == 0) {
+  int child_size = mem->child_size(node);
+  if (child_size == 0) {
     return -1;
   }
-  for (int i = 0 ; i < node->child_size; ++i) {
-    if (node->child[i]->N > most_visited) {
-      most_visited = node->child[i]->N;
-      //best_item = node->child[i]->item;
+  int first = mem->first_child(node);
+  int* N = &mem->N(first);
+  double* Q = &mem->Q(first);
+  int* item = &mem->item(first);
+  for (int i = 0 ; i < child_size; ++i) {
+    if (N[i] > most_visited) {
+      most_visited = N[i];
+      //best_item = item[i];
+    }
+    if (N[i] == 0) {
+      continue; // not visited yet e.g. the search stopped early
     }
-    // double score = node->child[i]->Q/node->child[i]->N + sqrt( logN/node->child[i]->N );
-    double score = node->child[i]->Q/node->child[i]->N;
+    // double score = Q[i]/N[i] + sqrt( logN/N[i] );
+    double score = Q[i]/N[i];
     if (score > highest_score) {
       highest_score = score;
-      highest_item = node->child[i]->item;
+      highest_item = item[i];
     }
   }
 // return highest_item;
   // break ties randomly
 #define MAX_BESTITEMS 100
 // printf("highest score:%g, item:%d, min score: %g\n", highest_score, highest_item, 0.95*highest_score);
+  if (most_visited == 0) {
+    // nothing visited, so nothing to go on
+    return item[(int)(rng->uniform()*(child_size-1)+0.5)];
+  }
   int best_items[MAX_BESTITEMS]; int num_bestitems=0;
-  for (int i = 0 ; i < node->child_size; ++i) {
-    double score = node->child[i]->Q/node->child[i]->N;
+  for (int i = 0 ; i < child_size; ++i) {
+    if (N[i] == 0) {
+      continue;
+    }
+    double score = Q[i]/N[i];
     if (score >= 0.95*highest_score) {
-      best_items[num_bestitems]=node->child[i]->item;
+      best_items[num_bestitems]=item[i];
       // printf("score:%g, item:%d\n", score, best_items[num_bestitems]);
       num_bestitems++;
       if (num_bestitems==MAX_BESTITEMS) {
@@ -216,7 +500,7 @@ int best_child2(TreeNode* node) {
       }
     }
   }
-  int rnd = (int)(uniform(gen)*(num_bestitems-1)+0.5);
+  int rnd = (int)(rng->uniform()*(num_bestitems-1)+0.5);
   // exit(0);
   return best_items[rnd];
 }
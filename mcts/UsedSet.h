@@ -0,0 +1,35 @@
+#pragma once
+
+// The items ruled out while expanding a node: the session's used items with the items
+// marked for this one expansion (the path, existing children) laid over them.  The marks
+// are generation stamps, so marking is O(number marked), begin() clears them all by bumping
+// the epoch, and the used items array is read in place rather than copied.
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+class UsedSet {
+public:
+  void begin(const int* used_items, int num_items) {
+    // start a new overlay, with no items marked, on top of used_items
+    used = used_items;
+    if ((int)stamp.size() < num_items) {
+      stamp.resize(num_items, 0);
+    }
+    if (++epoch == 0) {
+      // wrapped round, old stamps could match again
+      std::fill(stamp.begin(), stamp.end(), 0);
+      epoch = 1;
+    }
+  }
+
+  inline void mark(int item) { stamp[item] = epoch; }
+  inline bool marked(int item) const { return stamp[item] == epoch; }
+  inline bool contains(int item) const { return used[item] || stamp[item] == epoch; }
+
+private:
+  const int* used = nullptr;
+  std::vector<uint32_t> stamp;
+  uint32_t epoch = 0;
+};
@@ -8,15 +8,21 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <algorithm>
+#include <vector>
 #include <sys/stat.h>
 #include "MCTS.h"
 #include "Groups.h"
+#include "Search.h"
+#include "ColdStartSession.h"
+#include "Csv.h"
+#include "Model.h"
+#include "Server.h"
 
 using namespace std;
 
 #define MAX_VAL 6400
-#define MAX_NUM_ITEMS 1000
-#define MAX_NUM_SAMPLES 1000
 #define MAX_GROUPS 32
 #define MAX_ITERS 25
 
@@ -28,70 +34,31 @@ void usage(char *progname) {
   "          -t    sets number of cold start runs/users (average these to get performance stats)\n"
   "          -n    sets number of items user is asked to rate\n"
   "          -r    sets number of rollouts\n"
+  "          -b    sets binary model file to load instead of the csv files (see csv2model)\n"
+  "          -C    with -b, verifies the model file checksum on load, which reads the whole file\n"
   "          -u    sets file containing user ratings (rather than generating them randomly using means and variances)\n"
   "          -f    sets first item users are asked to rate\n"
+  "          -S    sets random number seed (runs are reproducible for a given seed)\n"
+  "          -p    sets number of threads searching each question (root parallel, independent trees)\n"
+  "          -P    sets number of threads searching each question (tree parallel, one shared tree)\n"
+  "          -V    sets virtual loss used by tree parallel search (default 1)\n"
+  "          -L    sets number of threads evaluating the rollouts from each leaf (leaf parallel), used only when a leaf has many rollouts over many groups\n"
+  "          -T    sets a per-question deadline in ms, the search stops there even if the simulation count isn't reached (default 0, off)\n"
+  "          -K    only puts this many of the items that best separate the groups in the tree (default 0, all items)\n"
+  "          -w    progressive widening, a node below the root visited N times gets ceil(N^w) children e.g. 0.5 (default 0, off)\n"
+  "          -M    caps the search tree memory at this many MB per tree, pruning low visit subtrees to stay under it.  the subtree copy made by -k shares the cap, beyond at most one block of nodes (default 0, no cap)\n"
+  "          -E    stops a question's search early once the best item is this many standard errors ahead of the rest, or stays best for a while e.g. 2 (default 0, off)\n"
+  "          -e    with -E, also stops once the best item has stayed the same for this many checks, 100 checks over the full budget (default 0, never)\n"
+  "          -J    serves cold-start sessions, reading json requests from stdin and writing responses to stdout (see Server.h)\n"
+  "          -j    with -J, searches for different sessions on this many worker threads, each with its own pooled tree memory (default 0, one request at a time)\n"
+  "          -A    with -J, refuses new sessions while this many are open (default 0, no limit)\n"
+  "          -k    keeps the subtree of the chosen item for the next question, discounting its stats by this factor e.g. 0.5 (default 0, off)\n"
+  "          -g    runs the gaussian generator self-test and benchmark, then exits\n"
   "          -v    enable debug output\n"
   "          -h    prints this message\n";
   printf(usage_str, progname);
 }
 
-void readcsv(char* fname, double **vals, int *rows, int *cols, int max_rows) {
-  FILE* f = fopen(fname,"r");
-  if (f==nullptr) {
-    char str[FILENAME_MAX];
-    snprintf(str,FILENAME_MAX,"ERROR: Can't open file %s\n",fname);
-    perror(str);
-    exit(1);
-  }
-  char buffer[1024*1024];
-  *cols=-1; *rows=0;
-  while (fgets(buffer, sizeof(buffer), f)) {
-    if (buffer[strlen(buffer)-1] != '\n') {
-      printf("ERROR: line too long in %s, didn't read to newline\n",fname);
-      exit(1);
-    }
-    int num_items_line=0;
-    char *token = strtok(buffer, ",");
-    while (token) {
-      //printf("%d %d, ",*rows,num_items_line);
-      vals[*rows][num_items_line] = atof(token);
-      num_items_line++;
-      //printf("%g ",n);
-      token = strtok(nullptr, ",");
-      if (num_items_line == MAX_NUM_ITEMS) {
-        printf("ERROR: Too many items >%d in %s\n", MAX_NUM_ITEMS,fname);
-        exit(1);
-      }
-    }
-    //printf("\n");
-    //printf("read %d items\n",num_items_line);
-    if (*cols<0) {
-      *cols = num_items_line;
-    } else if (*cols != num_items_line) {
-      printf("ERROR: inconsistent number of items %d/%d in %s\n",*cols,num_items_line,fname);
-      exit(1);
-    }
-    (*rows)++;
-    if (*rows > max_rows) {
-      printf("ERROR: Too many rows >%d in %s\n", max_rows,fname);
-      exit(1);
-    }
-  }
-}
-
-void read_vals(char* fname, double **vals, int *num_groups, int *num_items) {
-  // read items means from file - csv, with one row for each group
-  char cwd[PATH_MAX];
-  if (getcwd(cwd, sizeof(cwd)) == nullptr) {
-    perror("getcwd() error");
-    exit(1);
-  }
-  char valsfile[PATH_MAX+FILENAME_MAX];
-  snprintf(valsfile,FILENAME_MAX,"%s/%s",cwd,fname);
-  readcsv(valsfile, vals, num_groups, num_items, MAX_NUM_GROUPS);
-  printf("read from %s, num items %d, num_groups %d\n",valsfile,*num_items,*num_groups);
-}
-
 void toy_mu_and_sigma(double **mu, double **sigma2, int *num_groups, int *num_items) {
   // toy example
   const int num_groups_0=2;
@@ -107,41 +74,44 @@ void toy_mu_and_sigma(double **mu, double **sigma2, int *num_groups, int *num_it
   }
 }
 
-void read_user_ratings_csv(char* fname, double ***ratings, int num_groups, int num_items) {
+double*** read_user_ratings_csv(char* fname, int num_groups, int num_items, int* nsamples) {
+  // the file has nsamples rows of ratings for each group in turn, the ratings are stored
+  // negated.  returns ratings[group][sample][item]
   char cwd[PATH_MAX];
-  string fname_str = string(fname);
-  unsigned first = fname_str.find_last_of("_");
-  cout << first << endl;
-  unsigned last = fname_str.find(".");
-  cout << last << endl;
-  int nsamples = stoi(fname_str.substr(first + 1, last - first -1));
-  cout << nsamples << endl;
-
   if (getcwd(cwd, sizeof(cwd)) == nullptr) {
     perror("getcwd() error");
     exit(1);
   }
   char rname[PATH_MAX+FILENAME_MAX];
-  snprintf(rname,FILENAME_MAX,"%s/%s",cwd,fname);
-  int rows, cols;
-  double **vals;
-  vals = (double**)malloc(MAX_NUM_GROUPS*nsamples*sizeof(double*));
-  for (int i=0; i<MAX_NUM_GROUPS*nsamples; i++) {
-    vals[i] = (double*)malloc(MAX_NUM_ITEMS*sizeof(double));
+  snprintf(rname,sizeof(rname),"%s/%s",cwd,fname);
+  CsvTable* vals = new CsvTable(read_csv(rname)); // kept for the rest of the run
+  printf("read user ratings: %d %d\n",vals->rows, vals->cols);
+  if (vals->rows%num_groups != 0 || vals->cols != num_items) {
+    printf("ERROR: %s has %d rows of %d items, expected a multiple of %d rows of %d items\n",fname,vals->rows,vals->cols,num_groups,num_items);
+    exit(1);
   }
-  readcsv(rname, vals, &rows, &cols, num_items*nsamples);
-  printf("read user ratings: %d %d\n",rows, cols);
-  double mean[MAX_NUM_GROUPS][MAX_NUM_ITEMS]={};
+  *nsamples = vals->rows/num_groups;
+  for (double &r : vals->vals) {
+    r = -r; // need to flip sign back to positive
+  }
+  double*** ratings = (double***)malloc(num_groups*sizeof(double**));
   for (int i=0; i<num_groups; i++) {
-    for (int j=0; j<nsamples; j++) {
-      ratings[i][j] = vals[i*nsamples+j];
-      for (int k=0; k<num_items; k++) {
-        ratings[i][j][k] = -ratings[i][j][k]; // need to flip sign back to positive
-        mean[i][k]+=ratings[i][j][k]/nsamples;
-      }
+    ratings[i] = (double**)malloc(*nsamples*sizeof(double*));
+    for (int j=0; j<*nsamples; j++) {
+      ratings[i][j] = vals->row(i**nsamples+j);
     }
   }
-  free(vals);
+  return ratings;
+}
+
+double percentile(std::vector<double> vals, double p) {
+  // nearest rank percentile, p in [0,100]
+  if (vals.empty()) {
+    return 0;
+  }
+  std::sort(vals.begin(), vals.end());
+  size_t rank = (size_t)ceil(p/100.0*vals.size());
+  return vals[rank>0 ? rank-1 : 0];
 }
 
 int main(int argc, char **argv) {
@@ -163,6 +133,8 @@ int main(int argc, char **argv) {
 
   //char *ratings_fname=(char*)"test_data_netflix_8_500.csv";
   char *user_ratings_fname=nullptr;
+  char *model_fname=nullptr;
+  bool verify_model=false;
   int max_count=25; // number of items to ask user to rate
   int max_tries=1000;
   int num_rollouts=1;
@@ -172,11 +144,27 @@ int main(int argc, char **argv) {
   bool use_user_ratings = false;
   int first_item=-1;
   bool use_montecarlo=true;
+  uint64_t seed=(uint64_t)time(NULL);
+  bool run_rng_test=false;
+  int root_threads=1;
+  int tree_threads=1;
+  int virtual_loss=1;
+  int leaf_threads=1;
+  double reuse_discount=0.0;
+  double deadline=0.0;
+  int num_candidates=0;
+  double widen_alpha=0.0;
+  double max_tree_mb=0.0;
+  double stop_z=0.0;
+  int stop_stable=0;
+  bool serve_mode=false;
+  int serve_workers=0;
+  int max_sessions=0;
   //int first_item=199; //206, 113,75, 154
   
   // process command line options
   char c;
-  while ((c = (char)getopt(argc, argv,"m:s:t:n:r:f:u:vd:hd:l:c")) != EOF) {
+  while ((c = (char)getopt(argc, argv,"m:s:t:n:r:f:u:vd:hd:l:cS:gp:P:V:L:k:T:b:K:w:M:E:e:Jj:A:C")) != EOF) {
     switch(c) {
       case 'm':
         mu_fname = optarg;
@@ -209,6 +197,60 @@ int main(int argc, char **argv) {
       case 'c':
         use_montecarlo = false;
         break;
+      case 'S':
+        seed = strtoull(optarg, nullptr, 10);
+        break;
+      case 'g':
+        run_rng_test = true;
+        break;
+      case 'p':
+        root_threads = atoi(optarg);
+        break;
+      case 'P':
+        tree_threads = atoi(optarg);
+        break;
+      case 'V':
+        virtual_loss = atoi(optarg);
+        break;
+      case 'L':
+        leaf_threads = atoi(optarg);
+        break;
+      case 'k':
+        reuse_discount = atof(optarg);
+        break;
+      case 'E':
+        stop_z = atof(optarg);
+        break;
+      case 'J':
+        serve_mode = true;
+        break;
+      case 'j':
+        serve_workers = atoi(optarg);
+        break;
+      case 'A':
+        max_sessions = atoi(optarg);
+        break;
+      case 'e':
+        stop_stable = atoi(optarg);
+        break;
+      case 'M':
+        max_tree_mb = atof(optarg);
+        break;
+      case 'w':
+        widen_alpha = atof(optarg);
+        break;
+      case 'K':
+        num_candidates = atoi(optarg);
+        break;
+      case 'b':
+        model_fname = optarg;
+        break;
+      case 'C':
+        verify_model = true;
+        break;
+      case 'T':
+        deadline = atof(optarg);
+        break;
       case 'd':
         dataset = optarg;
         break;
@@ -222,151 +264,197 @@ int main(int argc, char **argv) {
         exit(1);
     }
   }
+  FILE* serve_out = nullptr;
+  if (serve_mode) {
+    // stdout carries the responses, so everything else printed goes to stderr
+    serve_out = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  }
   printf("settings: max tries=%d, max count %d, num rollouts %d, max_lookahead %d, max_num_rollouts %d first item %d\n", max_tries, max_count,num_rollouts, first_item,max_lookahead,max_num_rollouts);
-  
-  // read in per-group item rating means and variances
-  double **mu, **sigma2;
-  mu = (double**)malloc(MAX_NUM_GROUPS*sizeof(double*));
-  sigma2 = (double**)malloc(MAX_NUM_GROUPS*sizeof(double*));
-  for (int i=0; i<MAX_NUM_GROUPS; i++) {
-    mu[i] = (double*)malloc(MAX_NUM_ITEMS*sizeof(double));
-    sigma2[i] = (double*)malloc(MAX_NUM_ITEMS*sizeof(double));
+  printf("simd: %s, seed %llu, root threads %d, tree threads %d (virtual loss %d), leaf threads %d, subtree reuse %g, candidates %d, widening %g, early stop z %g stable %d\n", simd_names[simd_level], (unsigned long long)seed, root_threads, tree_threads, virtual_loss, leaf_threads, reuse_discount, num_candidates, widen_alpha, stop_z, stop_stable);
+  if (root_threads > 1 && tree_threads > 1) {
+    printf("ERROR: use either root parallel (-p) or tree parallel (-P) search, not both\n");
+    exit(1);
+  }
+  if (run_rng_test) {
+    int failed = rng_selftest(seed);
+    rng_benchmark(seed);
+    exit(failed ? 1 : 0);
   }
-  int num_groups,num_items;
-  read_vals(&mu_filename[0], mu, &num_groups, &num_items);
-  read_vals(&sigma_filename[0], sigma2, &num_groups, &num_items);
   
   Groups groups;
-  groups.create(num_groups, mu, sigma2, num_items);
+  if (model_fname) {
+    // binary model file, made by csv2model
+    auto load_start = chrono::steady_clock::now();
+    load_model(model_fname, &groups, verify_model);
+    printf("mapped model %s in %gms\n",model_fname,chrono::duration<double, milli>(chrono::steady_clock::now() - load_start).count());
+  } else {
+    // read in per-group item rating means and variances
+    CsvTable mu = read_vals(&mu_filename[0]);
+    CsvTable sigma2 = read_vals(&sigma_filename[0]);
+    if (mu.rows != sigma2.rows || mu.cols != sigma2.cols) {
+      printf("ERROR: %s is %dx%d but %s is %dx%d\n",mu_filename.c_str(),mu.rows,mu.cols,sigma_filename.c_str(),sigma2.rows,sigma2.cols);
+      exit(1);
+    }
+    std::vector<double*> mu_rows, sigma2_rows;
+    for (int g=0; g<mu.rows; g++) {
+      mu_rows.push_back(mu.row(g));
+      sigma2_rows.push_back(sigma2.row(g));
+    }
+    groups.create(mu.rows, mu_rows.data(), sigma2_rows.data(), mu.cols);
+    groups.mu = groups.sigma2 = nullptr; // only the item-major copies are kept
+  }
+  int num_groups = groups.num_groups, num_items = groups.num_items;
   printf("num groups %d, num_items %d\n",num_groups,num_items);
+  if (first_item >= num_items) {
+    printf("ERROR: first item %d is out of range, there are %d items\n",first_item,num_items);
+    exit(1);
+  }
 
   // read in pre-recorded user ratings, if specified
   double ***user_ratings=nullptr;
   if (user_ratings_fname) {
     // for testing, load dilina's user ratings data
-    user_ratings = (double***)malloc(MAX_NUM_GROUPS*sizeof(double**));
-    for (int i=0; i<MAX_NUM_GROUPS; i++) {
-      user_ratings[i] = (double**)malloc(MAX_NUM_SAMPLES*sizeof(double*));
+    int nsamples;
+    user_ratings = read_user_ratings_csv(user_ratings_fname, num_groups, num_items, &nsamples);
+    printf("read user ratings from %s, %d samples per group\n",user_ratings_fname,nsamples);
+    if (max_tries > nsamples) {
+      printf("ERROR: %d tries per group but only %d user rating samples per group\n",max_tries,nsamples);
+      exit(1);
     }
-    read_user_ratings_csv(user_ratings_fname,user_ratings, num_groups, num_items);
-    printf("read user ratings from %s\n",user_ratings_fname);
   }
   
-  const double time_limit = 0.0; // in milliseconds.  not used.
+  const double time_limit = 0.0; // in milliseconds, min search time per question.  not used.
+  SearchConfig cfg;
+  cfg.max_count = max_count;
+  cfg.num_rollouts = num_rollouts;
+  cfg.max_lookahead = max_lookahead;
+  cfg.max_num_rollouts = max_num_rollouts;
+  cfg.use_montecarlo = use_montecarlo;
+  cfg.time_limit = time_limit;
+  cfg.root_threads = root_threads;
+  cfg.tree_threads = tree_threads;
+  cfg.virtual_loss = virtual_loss;
+  cfg.leaf_threads = leaf_threads;
+  cfg.reuse_discount = reuse_discount;
+  cfg.deadline = deadline;
+  cfg.num_candidates = num_candidates;
+  cfg.widen_alpha = widen_alpha;
+  cfg.max_tree_bytes = (size_t)(max_tree_mb*1024*1024);
+  cfg.stop_z = stop_z;
+  cfg.stop_stable = stop_stable;
+#ifdef _OPENMP
+  if (root_threads > 1 || tree_threads > 1 || leaf_threads > 1) {
+    // the searches run nested parallel regions inside the loop over groups, and leaf
+    // parallel rollouts nest one level further inside those
+    omp_set_max_active_levels(1 + (root_threads > 1 || tree_threads > 1) + (leaf_threads > 1));
+  }
+#endif
+  if (serve_mode) {
+    Server server(&groups, cfg, seed, serve_workers, max_sessions);
+    return server.serve(stdin, serve_out);
+  }
   const int max_disp_count=25; // truncate lengthy output after this many lines
   
-  double rewards[MAX_NUM_GROUPS]={};
+  std::vector<double> rewards(num_groups, 0.0);
   auto overall_start = chrono::steady_clock::now();
   int disp_count=0;
-  // this magic openmp pragma parallelises the for loop, we keep separate state within loop
-  // so copies can be run without generating races.
+  // every (group, try) cold-start session is a separate task, so the work spreads over all
+  // the threads however many groups there are, and idle threads pick up the remaining
+  // tasks rather than waiting on a slow group.  each thread keeps its own ColdStartSession
+  // (trees and node memory are reused between its tasks) and each task has its own random
+  // streams, so results don't depend on which thread runs which task.
   // to install openmp use "brew install llvm omp"  (need to install llvm as default clang
   // install doesn't support openmp, sigh.
+  int num_tasks = num_groups*max_tries;
+  std::vector<char> success(num_tasks); // per task result, summed per group afterwards
+  // per question search latency and number of simulations, -1 if the question wasn't searched
+  std::vector<double> latency((size_t)num_tasks*max_count, -1.0);
+  std::vector<int> num_sims((size_t)num_tasks*max_count, -1);
+  int num_deadline_hits=0;
+  std::vector<long> stop_counts(NUM_STOP_REASONS, 0); // questions per stop reason
+  long total_sims=0, total_budget=0;
+#ifdef _OPENMP
+  int num_threads = omp_get_max_threads();
+#else
+  int num_threads = 1;
+#endif
+  std::vector<std::unique_ptr<ColdStartSession>> sessions(num_threads);
 
-
-
-  #pragma omp parallel for
-  for (int user_group=0; user_group<num_groups; user_group++) {
-    rewards[user_group]=0;
-    MonteCarloTree tree; // by keeping separate tree instances here we can parallelise loop
-    for (int tries=0; tries<max_tries; tries++){
-      if (disp_count<max_disp_count) {
-        printf("**try %d\n",tries);
+  #pragma omp parallel
+  #pragma omp single
+  #pragma omp taskloop grainsize(1)
+  for (int task=0; task<num_tasks; task++) {
+    int user_group = task/max_tries;
+    int tries = task%max_tries;
+#ifdef _OPENMP
+    int thread = omp_get_thread_num();
+#else
+    int thread = 0;
+#endif
+    if (!sessions[thread]) {
+      sessions[thread].reset(new ColdStartSession(&groups, cfg));
+    }
+    ColdStartSession* session = sessions[thread].get();
+    // separate random streams for the trees and for the user's ratings
+    session->start(seed, 2*(uint64_t)task);
+    Rng user_rng(seed, 2*(uint64_t)task+1);
+    if (__atomic_load_n(&disp_count, __ATOMIC_RELAXED)<max_disp_count) {
+      printf("**group %d try %d\n",user_group,tries);
+    }
+    
+    if (first_item>=0) {
+      // use pre-defined first item user is asked to rate
+      double r;
+      if (use_user_ratings) {
+        r = user_ratings[user_group][tries][first_item];
+      } else {
+        r = groups.rating(user_group,first_item,&user_rng);
       }
-      int used_items[MAX_NUM_ITEMS] = {};
-      int used_items_list[MAX_NUM_ITEMS] = {};
-      int num_used_items=0;
-      double ratings[MAX_NUM_ITEMS] = {};
-      double probs[MAX_NUM_GROUPS];
-      for (int g=0; g<num_groups; g++){
-        probs[g]=1.0/num_groups;
+      session->submit_rating(first_item, r);
+    }
+    
+    while (!session->done()) {
+      int num_used_items = session->num_ratings();
+      SearchResult res = session->next_item();
+      //std::vector<int> path={}; session->search.tree().print_tree(session->search.tree().root, path);
+      if (child_lowestN(&session->search.tree().treeMem, session->search.tree().root)==0) {
+        printf("WARNING: unvisited child nodes, increase simulation_counts from %d.\n", simulation_budget(cfg, num_items, num_used_items));
       }
-      
-      if (first_item>=0) {
-        // use pre-defined first item user is asked to rate
-        used_items[first_item]=1; // record that this item has now been used
-        used_items_list[num_used_items]=first_item;
-        if (use_user_ratings) {
-          ratings[num_used_items] = user_ratings[user_group][tries][first_item];
-        } else {
-          ratings[num_used_items] = groups.rating(user_group,first_item);
-        }
-        num_used_items++;
-        groups.calc_group_probs(used_items_list, ratings, num_used_items, probs);
+      latency[(size_t)task*max_count+num_used_items] = res.time_ms;
+      num_sims[(size_t)task*max_count+num_used_items] = res.num_sims;
+      if (res.deadline_hit) {
+        __atomic_fetch_add(&num_deadline_hits, 1, __ATOMIC_RELAXED);
       }
-      
-      while (num_used_items<max_count) {
-        tree.reset();
-        // hacky kind of heuristic for number of runs of mcts to use ...
-        // run out mem on my laptp if make prefactor larger than about 7.
-
-        int sim_k = 1;
-        int simulation_counts=int(sim_k*num_items*(1.25+(max_count-num_used_items)*(max_count-num_used_items)));
-
-        if (!use_montecarlo) {
-          simulation_counts=num_items;
-        }
-        /*for (int g=0; g<num_groups; g++){
-         printf("%g ",probs[g]);
-         }
-         printf("\n");*/
-        int count_sim = 0;
-        auto start = chrono::steady_clock::now();
-        double diff_time=0.0;
-        while ((count_sim < simulation_counts)||(diff_time < time_limit )) {
-          //printf("while %d\n",count_sim);
-          tree.run(&groups, probs, used_items, used_items_list, ratings, num_used_items, max_count, num_rollouts, max_lookahead, max_num_rollouts,use_montecarlo);
-
-          count_sim++;
-          diff_time = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
-        }
-        //std::vector<int> path={}; tree.print_tree(tree.root, path);
-        if (child_lowestN(tree.root)==0) {
-          printf("WARNING: unvisited child nodes, increase simulation_counts from %d.\n", simulation_counts);
-        }
-        int next_item = best_child2(tree.root);
-        used_items[next_item]=1; // record that this item has now been used
-        used_items_list[num_used_items]=next_item;
-        //user_group=1;
-        if (user_ratings) {
-          // use pre-recorded user ratings
-          ratings[num_used_items] = user_ratings[user_group][tries][next_item];
-        } else {
-          // generate a random rating with specified mean and variance
-          ratings[num_used_items] = groups.rating(user_group,next_item);
-        }
-        if (disp_count<max_disp_count) {
-          // stop display once gets larger
-          printf("%d %d %g, time %gms/num runs %d\n",num_used_items,next_item,ratings[num_used_items],diff_time, count_sim);
-          disp_count++;
-        }
-        num_used_items++;
-        groups.calc_group_probs(used_items_list, ratings, num_used_items, probs);
+      __atomic_fetch_add(&stop_counts[res.stop_reason], 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&total_sims, (long)res.num_sims, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&total_budget, (long)res.budget, __ATOMIC_RELAXED);
+      int next_item = res.item;
+      double r;
+      if (user_ratings) {
+        // use pre-recorded user ratings
+        r = user_ratings[user_group][tries][next_item];
+      } else {
+        // generate a random rating with specified mean and variance
+        r = groups.rating(user_group,next_item,&user_rng);
       }
-      /*for (int g=0; g<num_groups; g++){
-       printf("%g ",probs[g]);
-       }
-       printf("\n");*/
-      int g = groups.estimated_group(used_items_list, ratings, num_used_items);
-      //printf("g=%d\n",g);
-      if (g==user_group) {
-        rewards[user_group]++;
+      if (__atomic_load_n(&disp_count, __ATOMIC_RELAXED)<max_disp_count) {
+        // stop display once gets larger
+        printf("%d %d %g, time %gms/num runs %d, budget %d stop %s\n",num_used_items,next_item,r,res.time_ms, res.num_sims, res.budget, stop_names[res.stop_reason]);
+        __atomic_fetch_add(&disp_count, 1, __ATOMIC_RELAXED);
       }
-      
-      // for(int i = 0; i < num_used_items; i++){
-        
-      //   int g = groups.estimated_group(used_items_list, ratings, i+1);
-      //   if (g==user_group) {
-      //     group_acc[user_group][i] += 1;
-      //   }
-      // }
-
-      
+      session->submit_rating(next_item, r);
     }
+    int g = session->estimated_group();
+    success[task] = (g==user_group);
+  }
+  for (int task=0; task<num_tasks; task++) {
+    rewards[task/max_tries] += success[task];
+  }
+  for (int user_group=0; user_group<num_groups; user_group++) {
     rewards[user_group] = rewards[user_group]*1.0/max_tries;
     printf("group %d success rate %g\n", user_group, rewards[user_group]);
   }
-  
 
   const int dir_err = mkdir("output", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
   if (-1 == dir_err){
@@ -375,6 +463,29 @@ int main(int argc, char **argv) {
   
   printf("time taken %g sec\n",chrono::duration<double, milli>(chrono::steady_clock::now() - overall_start).count()/1000.0);
 
+  std::vector<double> lat, sims;
+  for (size_t i=0; i<latency.size(); i++) {
+    if (latency[i] >= 0) {
+      lat.push_back(latency[i]);
+      sims.push_back(num_sims[i]);
+    }
+  }
+  printf("question latency ms p50 %g p90 %g p99 %g max %g\n", percentile(lat,50), percentile(lat,90), percentile(lat,99), percentile(lat,100));
+  printf("question simulations p1 %g p50 %g p99 %g, deadline hit %d/%d\n", percentile(sims,1), percentile(sims,50), percentile(sims,99), num_deadline_hits, (int)lat.size());
+  printf("simulations used %.3g of budget, stopped by", total_budget > 0 ? (double)total_sims/total_budget : 0.0);
+  for (int r=0; r<NUM_STOP_REASONS; r++) {
+    printf(" %s %ld", stop_names[r], stop_counts[r]);
+  }
+  printf("\n");
+  size_t peak_bytes=0, bytes=0;
+  for (auto &s : sessions) {
+    if (s) {
+      peak_bytes = s->search.peak_bytes() > peak_bytes ? s->search.peak_bytes() : peak_bytes;
+      bytes += s->search.bytes();
+    }
+  }
+  printf("tree memory per search peak %.2f MB (cap %g MB per tree), held now by all searches %.2f MB\n", peak_bytes/1048576.0, max_tree_mb, bytes/1048576.0);
+
   printf("acc per iter:\n");
   for (int i=0; i<max_count; i++) {
     printf("%4d ",i+1);
@@ -0,0 +1,324 @@
+#pragma once
+
+// SIMD kernels for the hot loops, with runtime dispatch on the CPU we find ourselves
+// running on so that one binary (built without -march=native) runs on any x86-64 box
+// but still uses AVX2/AVX-512 when available.  Other architectures get the scalar code.
+// Every variant rounds exactly as the scalar one does (no fused mul+add, sums in a fixed
+// order), as long as it is built with -ffp-contract=off like the Makefile does.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+enum SimdLevel { SIMD_SCALAR=0, SIMD_AVX2=1, SIMD_AVX512=2 };
+inline const char* simd_names[] = {"scalar", "avx2", "avx512"};
+
+inline SimdLevel detect_simd_level() {
+  // environment variable MCTS_SIMD=scalar|avx2|avx512 caps the level used, handy for benchmarking
+  SimdLevel level = SIMD_SCALAR;
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    level = SIMD_AVX512;
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    level = SIMD_AVX2;
+  }
+#endif
+  const char* env = getenv("MCTS_SIMD");
+  if (env != nullptr) {
+    for (int l=SIMD_SCALAR; l<=SIMD_AVX512; l++) {
+      if ((strcmp(env,simd_names[l])==0) && (l<level)) {
+        level = (SimdLevel)l;
+      }
+    }
+  }
+  return level;
+}
+inline SimdLevel simd_level = detect_simd_level();
+
+// UCB scores for a packed block of child stats i.e. score[i] = Q[i]/N[i] + sqrt(logN/N[i]).
+// returns the index of the first unvisited child (N[i]==0), in which case score[] is
+// only filled up to that point, or -1 if all children have been visited.
+typedef int (*ucb_scores_fn)(const double* Q, const int* N, int n, double logN, double* score);
+
+inline int ucb_scores_tail(const double* Q, const int* N, int start, int n, double logN, double* score) {
+  for (int i=start; i<n; i++) {
+    if (N[i]==0) {
+      return i;
+    }
+    score[i] = Q[i]/N[i] + sqrt(logN/N[i]);
+  }
+  return -1;
+}
+
+inline int ucb_scores_scalar(const double* Q, const int* N, int n, double logN, double* score) {
+  return ucb_scores_tail(Q, N, 0, n, logN, score);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2,fma")))
+inline int ucb_scores_avx2(const double* Q, const int* N, int n, double logN, double* score) {
+  const __m256d vlogN = _mm256_set1_pd(logN);
+  int i=0;
+  for (; i+4<=n; i+=4) {
+    __m128i n4 = _mm_loadu_si128((const __m128i*)(N+i));
+    int zero = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(n4, _mm_setzero_si128())));
+    if (zero) {
+      return i + __builtin_ctz(zero);
+    }
+    __m256d nd = _mm256_cvtepi32_pd(n4);
+    __m256d exploit = _mm256_div_pd(_mm256_loadu_pd(Q+i), nd);
+    __m256d explore = _mm256_sqrt_pd(_mm256_div_pd(vlogN, nd));
+    _mm256_storeu_pd(score+i, _mm256_add_pd(exploit, explore));
+  }
+  return ucb_scores_tail(Q, N, i, n, logN, score);
+}
+
+__attribute__((target("avx512f")))
+inline int ucb_scores_avx512(const double* Q, const int* N, int n, double logN, double* score) {
+  const __m512d vlogN = _mm512_set1_pd(logN);
+  int i=0;
+  // the maskz forms avoid a spurious gcc -Wmaybe-uninitialized warning from _mm512_undefined_pd()
+  const __mmask8 all = 0xFF;
+  for (; i+8<=n; i+=8) {
+    __m512d nd = _mm512_maskz_cvtepi32_pd(all, _mm256_loadu_si256((const __m256i*)(N+i)));
+    __mmask8 zero = _mm512_cmpeq_pd_mask(nd, _mm512_setzero_pd());
+    if (zero) {
+      return i + __builtin_ctz(zero);
+    }
+    __m512d exploit = _mm512_div_pd(_mm512_loadu_pd(Q+i), nd);
+    __m512d explore = _mm512_maskz_sqrt_pd(all, _mm512_div_pd(vlogN, nd));
+    _mm512_storeu_pd(score+i, _mm512_add_pd(exploit, explore));
+  }
+  return ucb_scores_tail(Q, N, i, n, logN, score);
+}
+#endif
+
+inline ucb_scores_fn select_ucb_scores() {
+#ifdef SIMD_X86
+  if (simd_level >= SIMD_AVX512) return ucb_scores_avx512;
+  if (simd_level >= SIMD_AVX2) return ucb_scores_avx2;
+#endif
+  return ucb_scores_scalar;
+}
+inline ucb_scores_fn ucb_scores = select_ucb_scores();
+
+// padding and alignment of per-group arrays, so a sweep over groups never needs a
+// scalar tail and vector loads never straddle a cache line
+#define SIMD_ALIGN 64
+#define SIMD_GROUP_PAD 8
+
+inline int simd_pad(int n) {
+  return (n+SIMD_GROUP_PAD-1)/SIMD_GROUP_PAD*SIMD_GROUP_PAD;
+}
+
+inline double* simd_alloc(size_t n) {
+  // zeroed, SIMD_ALIGN aligned array of n doubles
+  size_t bytes = (n*sizeof(double)+SIMD_ALIGN-1)/SIMD_ALIGN*SIMD_ALIGN;
+  double* p = (double*)aligned_alloc(SIMD_ALIGN, bytes);
+  if (p == nullptr) {
+    printf("ERROR: out of memory allocating %zu bytes\n",bytes);
+    exit(1);
+  }
+  memset(p, 0, bytes);
+  return p;
+}
+
+// squared error update over all groups for one rated item i.e.
+// err[g] += (r-mu[g])^2*inv_sigma2[g] for g<n, n a multiple of SIMD_GROUP_PAD
+typedef void (*sq_err_fn)(const double* mu, const double* inv_sigma2, double r, double* err, int n);
+
+inline void sq_err_scalar(const double* mu, const double* inv_sigma2, double r, double* err, int n) {
+  for (int g=0; g<n; g++) {
+    double d = r-mu[g];
+    err[g] += d*d*inv_sigma2[g];
+  }
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2,fma")))
+inline void sq_err_avx2(const double* mu, const double* inv_sigma2, double r, double* err, int n) {
+  const __m256d vr = _mm256_set1_pd(r);
+  for (int g=0; g<n; g+=4) {
+    __m256d d = _mm256_sub_pd(vr, _mm256_loadu_pd(mu+g));
+    __m256d w = _mm256_mul_pd(_mm256_mul_pd(d, d), _mm256_loadu_pd(inv_sigma2+g));
+    _mm256_storeu_pd(err+g, _mm256_add_pd(_mm256_loadu_pd(err+g), w));
+  }
+}
+
+__attribute__((target("avx512f")))
+inline void sq_err_avx512(const double* mu, const double* inv_sigma2, double r, double* err, int n) {
+  const __m512d vr = _mm512_set1_pd(r);
+  for (int g=0; g<n; g+=8) {
+    __m512d d = _mm512_sub_pd(vr, _mm512_loadu_pd(mu+g));
+    __m512d w = _mm512_mul_pd(_mm512_mul_pd(d, d), _mm512_loadu_pd(inv_sigma2+g));
+    _mm512_storeu_pd(err+g, _mm512_add_pd(_mm512_loadu_pd(err+g), w));
+  }
+}
+#endif
+
+inline sq_err_fn select_sq_err() {
+#ifdef SIMD_X86
+  if (simd_level >= SIMD_AVX512) return sq_err_avx512;
+  if (simd_level >= SIMD_AVX2) return sq_err_avx2;
+#endif
+  return sq_err_scalar;
+}
+inline sq_err_fn sq_err = select_sq_err();
+
+// Box-Muller transform of a batch of random bits into 2n standard normals.  bits[i] and
+// bits[n+i] give the pair of uniforms for normals out[i] and out[n+i].  log and sin/cos are
+// branch-free polynomial approximations (accurate to ~1e-13) so the loop vectorises.
+typedef void (*gaussian_batch_fn)(const uint32_t* bits, int n, double* out);
+
+inline __attribute__((always_inline)) double bm_log(double x) {
+  // x>0 normal. split x=m*2^e with m in [sqrt(1/2),sqrt(2)), then log(m)=2atanh((m-1)/(m+1))
+  int64_t b = __builtin_bit_cast(int64_t, x);
+  double e = __builtin_bit_cast(double, (b>>52) | 0x4330000000000000LL) - (4503599627370496.0+1023.0);
+  double m = __builtin_bit_cast(double, (b & 0x000fffffffffffffLL) | 0x3ff0000000000000LL);
+  double big = m > 1.4142135623730951 ? 1.0 : 0.0;
+  m = m - 0.5*m*big;
+  e = e + big;
+  double f = (m-1.0)/(m+1.0), f2 = f*f;
+  double p = 1.0/15;
+  p = p*f2+1.0/13; p = p*f2+1.0/11; p = p*f2+1.0/9; p = p*f2+1.0/7;
+  p = p*f2+1.0/5; p = p*f2+1.0/3; p = p*f2+1.0;
+  return 2.0*f*p + e*0.6931471805599453;
+}
+
+inline __attribute__((always_inline)) void gaussian_batch_body(const uint32_t* bits, int n, double* out) {
+  const uint32_t* b1 = bits;
+  const uint32_t* b2 = bits+n;
+#pragma omp simd
+  for (int i=0; i<n; i++) {
+    // convert via signed ints, unsigned->double doesn't vectorise before avx-512.  u1 in (0,1], u2 in [0,1)
+    double u1 = ((double)(int32_t)(b1[i]^0x80000000u)+2147483649.0)*(1.0/4294967296.0);
+    double u2 = ((double)(int32_t)(b2[i]^0x80000000u)+2147483648.0)*(1.0/4294967296.0);
+    double r = sqrt(-2.0*bm_log(u1));
+    // angle 2*pi*u2 = x + q*pi/2 with x in [-pi/4,pi/4]
+    double q = floor(4.0*u2+0.5);
+    double x = 6.283185307179586*(u2-0.25*q);
+    double x2 = x*x;
+    double s = x*(1 + x2*(-1.0/6 + x2*(1.0/120 + x2*(-1.0/5040 + x2*(1.0/362880 + x2*(-1.0/39916800 + x2*(1.0/6227020800)))))));
+    double c = 1 + x2*(-0.5 + x2*(1.0/24 + x2*(-1.0/720 + x2*(1.0/40320 + x2*(-1.0/3628800 + x2*(1.0/479001600 + x2*(-1.0/87178291200)))))));
+    // rotate (c,s) by q quarter turns
+    double swap = (q==1.0 || q==3.0) ? 1.0 : 0.0;
+    double sign_c = (q==1.0 || q==2.0) ? -1.0 : 1.0;
+    double sign_s = (q==2.0 || q==3.0) ? -1.0 : 1.0;
+    double cq = swap ? s : c;
+    double sq = swap ? c : s;
+    out[i] = r*sign_c*cq;
+    out[n+i] = r*sign_s*sq;
+  }
+}
+
+inline void gaussian_batch_scalar(const uint32_t* bits, int n, double* out) {
+  gaussian_batch_body(bits, n, out);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2,fma")))
+inline void gaussian_batch_avx2(const uint32_t* bits, int n, double* out) {
+  gaussian_batch_body(bits, n, out);
+}
+
+__attribute__((target("avx512f")))
+inline void gaussian_batch_avx512(const uint32_t* bits, int n, double* out) {
+  gaussian_batch_body(bits, n, out);
+}
+#endif
+
+inline gaussian_batch_fn select_gaussian_batch() {
+#ifdef SIMD_X86
+  if (simd_level >= SIMD_AVX512) return gaussian_batch_avx512;
+  if (simd_level >= SIMD_AVX2) return gaussian_batch_avx2;
+#endif
+  return gaussian_batch_scalar;
+}
+inline gaussian_batch_fn gaussian_batch = select_gaussian_batch();
+
+// Group probabilities from the posterior sums, worked in the log domain so they can't
+// underflow or overflow however many items are rated:
+//   probs[g] = exp(l[g]-max(l)) / sum_g' exp(l[g']-max(l)),  l[g] = -err[g]/2-log_norm[g]
+// exp is a branch-free polynomial (accurate to ~1e-15) so the loops vectorise.
+typedef void (*group_probs_fn)(const double* err, const double* log_norm, int n, double* probs);
+
+inline __attribute__((always_inline)) double fast_exp(double x) {
+  // x<=0. exp(x)=2^k*exp(r) with k=round(x/log(2)) and |r|<=log(2)/2, results below
+  // ~1e-307 are flushed to zero
+  double under = x > -708.0 ? 1.0 : 0.0;
+  x = x > -708.0 ? x : -708.0;
+  double kd = x*1.4426950408889634 + 6755399441055744.0; // adding 1.5*2^52 rounds to an int
+  int64_t kb = __builtin_bit_cast(int64_t, kd);
+  kd -= 6755399441055744.0;
+  double r = x - kd*0.6931471803691238 - kd*1.9082149292705877e-10;
+  double p = 1.0/6227020800;
+  p = p*r+1.0/479001600; p = p*r+1.0/39916800; p = p*r+1.0/3628800; p = p*r+1.0/362880;
+  p = p*r+1.0/40320; p = p*r+1.0/5040; p = p*r+1.0/720; p = p*r+1.0/120;
+  p = p*r+1.0/24; p = p*r+1.0/6; p = p*r+0.5; p = p*r+1.0; p = p*r+1.0;
+  // the low bits of kd hold k, clamp it to the normal exponents and build 2^k unsigned
+  int64_t k = kb - 0x4338000000000000LL;
+  k = k < -1022 ? -1022 : k;
+  k = k > 1023 ? 1023 : k;
+  double scale = __builtin_bit_cast(double, (uint64_t)(k+1023) << 52);
+  return p*scale*under;
+}
+
+inline __attribute__((always_inline)) void group_probs_body(const double* err, const double* log_norm, int n, double* probs) {
+  double max_l = -INFINITY;
+#pragma omp simd reduction(max:max_l)
+  for (int g=0; g<n; g++) {
+    probs[g] = -0.5*err[g]-log_norm[g];
+    max_l = probs[g] > max_l ? probs[g] : max_l;
+  }
+#pragma omp simd
+  for (int g=0; g<n; g++) {
+    probs[g] = fast_exp(probs[g]-max_l);
+  }
+  // summed in SIMD_GROUP_PAD lanes and then pairwise, whatever the vector width, so
+  // every variant rounds the same way
+  double lane[SIMD_GROUP_PAD] = {0};
+  for (int g=0; g<n; g+=SIMD_GROUP_PAD) {
+    for (int j=0; j<SIMD_GROUP_PAD; j++) {
+      lane[j] += g+j < n ? probs[g+j] : 0.0;
+    }
+  }
+  double sum = ((lane[0]+lane[1])+(lane[2]+lane[3]))+((lane[4]+lane[5])+(lane[6]+lane[7]));
+  double inv_sum = 1.0/sum;
+#pragma omp simd
+  for (int g=0; g<n; g++) {
+    probs[g] *= inv_sum;
+  }
+}
+
+inline void group_probs_scalar(const double* err, const double* log_norm, int n, double* probs) {
+  group_probs_body(err, log_norm, n, probs);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2,fma")))
+inline void group_probs_avx2(const double* err, const double* log_norm, int n, double* probs) {
+  group_probs_body(err, log_norm, n, probs);
+}
+
+__attribute__((target("avx512f")))
+inline void group_probs_avx512(const double* err, const double* log_norm, int n, double* probs) {
+  group_probs_body(err, log_norm, n, probs);
+}
+#endif
+
+inline group_probs_fn select_group_probs() {
+#ifdef SIMD_X86
+  if (simd_level >= SIMD_AVX512) return group_probs_avx512;
+  if (simd_level >= SIMD_AVX2) return group_probs_avx2;
+#endif
+  return group_probs_scalar;
+}
+inline group_probs_fn group_probs = select_group_probs();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdlib.h>
 
 //#define DEBUG_DL 1
@@ -10,11 +11,11 @@
 #else
 #define DEBUG_PRINT(...) do {} while (0)
 #endif*/
-bool debug = false; // debugging output
+inline bool debug = false; // debugging output
 #define DEBUG_PRINT(args ...) if (debug) printf(args)
 
 
-void print_items(int* items, int num_items) {
+inline void print_items(int* items, int num_items) {
   for (int i=0; i<num_items; i++) {
     DEBUG_PRINT("%d ",items[i]);
   }
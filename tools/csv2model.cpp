@@ -0,0 +1,55 @@
+// Converts a pair of per-group item rating mean and variance csv files into a binary
+// model file that mcts can map directly with -b, e.g.
+//   bin/csv2model data/mu_netflix8.csv data/sigma_netflix8.csv data/netflix8.model
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "../mcts/Csv.h"
+#include "../mcts/Groups.h"
+#include "../mcts/Model.h"
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    printf("usage: %s <mu csv> <sigma2 csv> <output model file>\n", argv[0]);
+    exit(1);
+  }
+  auto start = std::chrono::steady_clock::now();
+  CsvTable mu = read_csv(argv[1]);
+  CsvTable sigma2 = read_csv(argv[2]);
+  int num_groups = mu.rows, num_items = mu.cols;
+  if (sigma2.rows != num_groups || sigma2.cols != num_items) {
+    printf("ERROR: %s is %dx%d but %s is %dx%d\n", argv[1], num_groups, num_items, argv[2], sigma2.rows, sigma2.cols);
+    exit(1);
+  }
+  if (num_groups == 0 || num_items == 0) {
+    printf("ERROR: %s is empty\n", argv[1]);
+    exit(1);
+  }
+  std::vector<double*> mu_rows, sigma2_rows;
+  for (int g=0; g<num_groups; g++) {
+    mu_rows.push_back(mu.row(g));
+    sigma2_rows.push_back(sigma2.row(g));
+    for (int i=0; i<num_items; i++) {
+      if (!(sigma2.row(g)[i] > 0)) {
+        printf("ERROR: variance %g for group %d item %d is not positive\n", sigma2.row(g)[i], g, i);
+        exit(1);
+      }
+    }
+  }
+  Groups groups;
+  groups.create(num_groups, mu_rows.data(), sigma2_rows.data(), num_items);
+  write_model(argv[3], &groups);
+
+  // read it back to check
+  Groups check;
+  load_model(argv[3], &check, true);
+  for (size_t k=0; k<(size_t)num_items*groups.group_stride; k++) {
+    if (check.mu_t[k] != groups.mu_t[k] || check.sigma2_t[k] != groups.sigma2_t[k]) {
+      printf("ERROR: %s doesn't read back correctly\n", argv[3]);
+      exit(1);
+    }
+  }
+  printf("wrote %s: %d groups, %d items, in %gms\n", argv[3], num_groups, num_items,
+         std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}